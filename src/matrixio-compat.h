@@ -100,4 +100,70 @@
         } while (0)
 #endif
 
+/* gpiolib wants immutable irq_chips from 5.19 on, older kernels patch the
+ * chip's callbacks themselves */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+    #define MATRIXIO_GPIO_IRQ_FLAGS IRQCHIP_IMMUTABLE
+    #define MATRIXIO_GPIO_IRQ_RESOURCE_HELPERS GPIOCHIP_IRQ_RESOURCE_HELPERS
+    #define MATRIXIO_GPIO_IRQ_SET_CHIP(girq, irqchip) gpio_irq_chip_set_chip(girq, irqchip)
+    #define MATRIXIO_GPIO_IRQ_ENABLE(gc, hwirq) gpiochip_enable_irq(gc, hwirq)
+    #define MATRIXIO_GPIO_IRQ_DISABLE(gc, hwirq) gpiochip_disable_irq(gc, hwirq)
+#else
+    #define MATRIXIO_GPIO_IRQ_FLAGS 0
+    #define MATRIXIO_GPIO_IRQ_RESOURCE_HELPERS
+    #define MATRIXIO_GPIO_IRQ_SET_CHIP(girq, irqchip) ((girq)->chip = (irqchip))
+    #define MATRIXIO_GPIO_IRQ_ENABLE(gc, hwirq) do {} while (0)
+    #define MATRIXIO_GPIO_IRQ_DISABLE(gc, hwirq) do {} while (0)
+#endif
+
+/* pwm_ops.get_state returns an error code from 6.2 on */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+    #define MATRIXIO_PWM_GET_STATE_TYPE int
+    #define MATRIXIO_PWM_GET_STATE_RETURN() return 0
+#else
+    #define MATRIXIO_PWM_GET_STATE_TYPE void
+    #define MATRIXIO_PWM_GET_STATE_RETURN() return
+#endif
+
+/* sched_set_fifo() and mul_u64_u64_div_u64() arrived in 5.9, when
+ * sched_setscheduler() stopped being exported to modules */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+    #define MATRIXIO_SCHED_SET_FIFO(p) sched_set_fifo(p)
+    #define MATRIXIO_MUL_U64_U64_DIV_U64(a, b, c) mul_u64_u64_div_u64(a, b, c)
+#else
+    #include <linux/math64.h>
+    #include <linux/sched.h>
+    #include <linux/sched/prio.h>
+    #include <linux/sched/types.h>
+
+    static inline void matrixio_sched_set_fifo(struct task_struct *p)
+    {
+        struct sched_param sp = { .sched_priority = MAX_RT_PRIO / 2 };
+
+        WARN_ON_ONCE(sched_setscheduler(p, SCHED_FIFO, &sp) != 0);
+    }
+
+    /* Exact as long as (a % c) * b fits in 64 bits */
+    static inline u64 matrixio_mul_u64_u64_div_u64(u64 a, u64 b, u64 c)
+    {
+        u64 rem, quot = div64_u64_rem(a, c, &rem);
+
+        return quot * b + div64_u64(rem * b, c);
+    }
+
+    #define MATRIXIO_SCHED_SET_FIFO(p) matrixio_sched_set_fifo(p)
+    #define MATRIXIO_MUL_U64_U64_DIV_U64(a, b, c) \
+        matrixio_mul_u64_u64_div_u64(a, b, c)
+#endif
+
+/* Lets the KUnit tests reach helpers that are otherwise static */
+#if IS_ENABLED(CONFIG_KUNIT) && LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+    #include <kunit/visibility.h>
+    #define MATRIXIO_KUNIT_VISIBLE 1
+#else
+    #define VISIBLE_IF_KUNIT static
+    #define EXPORT_SYMBOL_IF_KUNIT(symbol)
+    #define MATRIXIO_KUNIT_VISIBLE 0
+#endif
+
 #endif /* MATRIXIO_COMPAT_H */
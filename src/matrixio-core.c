@@ -12,12 +12,16 @@
  *  option) any later version.
  */
 
+#include <linux/iio/iio.h>
+#include <linux/iio/trigger.h>
 #include <linux/init.h>
 #include <linux/kernel.h>
+#include <linux/math64.h>
 #include <linux/mfd/core.h>
 #include <linux/module.h>
 #include <linux/of.h>
 #include <linux/regmap.h>
+#include <linux/slab.h>
 #include <linux/spi/spi.h>
 
 #include "matrixio-core.h"
@@ -93,27 +97,33 @@ static int matrixio_small_read(struct matrixio *matrixio, unsigned int add, int
 	return ret;
 }
 
+/* Caller holds reg_lock */
+static int matrixio_read_locked(struct matrixio *matrixio, unsigned int add,
+				int length, void *data)
+{
+	if (length > MATRIXIO_SPI_BOUNCE_SIZE - sizeof(struct hardware_cmd))
+		return matrixio_large_read(matrixio, add, length, data);
+
+	return matrixio_small_read(matrixio, add, length, data);
+}
+
 int matrixio_read(struct matrixio *matrixio, unsigned int add, int length,
 		  void *data)
 {
 	int ret;
 
 	mutex_lock(&matrixio->reg_lock);
-	if (length > MATRIXIO_SPI_BOUNCE_SIZE - sizeof(struct hardware_cmd)) {
-		ret = matrixio_large_read(matrixio, add, length, data);
-	} else {
-		ret = matrixio_small_read(matrixio, add, length, data);
-	}
+	ret = matrixio_read_locked(matrixio, add, length, data);
 	mutex_unlock(&matrixio->reg_lock);
 
 	return ret;
 }
 EXPORT_SYMBOL(matrixio_read);
 
-int matrixio_write(struct matrixio *matrixio, unsigned int add, int length,
-		   void *data)
+/* Caller holds reg_lock */
+static int matrixio_write_locked(struct matrixio *matrixio, unsigned int add,
+				 int length, void *data)
 {
-	int ret;
 	struct hardware_cmd *hw_cmd = (struct hardware_cmd*)matrixio->tx_buffer;
 	struct spi_transfer xfers[2] = {
 		{
@@ -122,8 +132,6 @@ int matrixio_write(struct matrixio *matrixio, unsigned int add, int length,
 	};
 	struct spi_message m;
 
-	mutex_lock(&matrixio->reg_lock);
-
 	hw_cmd->reg = add;
 	hw_cmd->readnwrite = 0;
 	if (length > MATRIXIO_SPI_BOUNCE_SIZE - sizeof(*hw_cmd)) {
@@ -137,17 +145,131 @@ int matrixio_write(struct matrixio *matrixio, unsigned int add, int length,
 		spi_message_init_with_transfers(&m, xfers, 1);
 	}
 
-	ret = spi_sync(matrixio->spi, &m);
+	return spi_sync(matrixio->spi, &m);
+}
+
+int matrixio_write(struct matrixio *matrixio, unsigned int add, int length,
+		   void *data)
+{
+	int ret;
+
+	mutex_lock(&matrixio->reg_lock);
+	ret = matrixio_write_locked(matrixio, add, length, data);
 	mutex_unlock(&matrixio->reg_lock);
 
 	return ret;
 }
 EXPORT_SYMBOL(matrixio_write);
 
+/* Lays the accesses out back to back in tx, each behind its command word,
+ * with one transfer per access.  Read data lands at the same offsets in rx.
+ * Returns the bytes used. */
+VISIBLE_IF_KUNIT size_t matrixio_xfer_pack(const struct matrixio_xfer *xfers,
+					   int count, u8 *tx, u8 *rx,
+					   struct spi_transfer *t)
+{
+	struct hardware_cmd hw_cmd;
+	size_t off = 0;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		hw_cmd.reg = xfers[i].add;
+		hw_cmd.readnwrite = xfers[i].read;
+		memcpy(tx + off, &hw_cmd, sizeof(hw_cmd));
+		if (!xfers[i].read)
+			memcpy(tx + off + sizeof(hw_cmd), xfers[i].data,
+			       xfers[i].length);
+
+		t[i].tx_buf = tx + off;
+		t[i].rx_buf = xfers[i].read ? rx + off : NULL;
+		t[i].len = sizeof(hw_cmd) + xfers[i].length;
+		t[i].cs_change = i < count - 1;
+		off += t[i].len;
+	}
+
+	return off;
+}
+EXPORT_SYMBOL_IF_KUNIT(matrixio_xfer_pack);
+
+/* Copies read data out of the rx layout built by matrixio_xfer_pack() */
+VISIBLE_IF_KUNIT void matrixio_xfer_unpack(struct matrixio_xfer *xfers,
+					   int count, const u8 *rx)
+{
+	size_t off = 0;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (xfers[i].read)
+			memcpy(xfers[i].data,
+			       rx + off + sizeof(struct hardware_cmd),
+			       xfers[i].length);
+		off += sizeof(struct hardware_cmd) + xfers[i].length;
+	}
+}
+EXPORT_SYMBOL_IF_KUNIT(matrixio_xfer_unpack);
+
+/* Run several bus accesses in one SPI message.  Chip select is released
+ * between them so the FPGA sees each one as a separate command.  All the data
+ * is bounced, so the caller's buffers don't need to be DMA safe. */
+int matrixio_xfer_batch(struct matrixio *matrixio,
+			struct matrixio_xfer *xfers, int count)
+{
+	struct spi_transfer *t;
+	struct spi_message m;
+	size_t total = 0;
+	bool any_read = false;
+	u8 *tx, *rx;
+	int i, ret;
+
+	if (count <= 0)
+		return 0;
+
+	for (i = 0; i < count; i++) {
+		if (xfers[i].add > MATRIXIO_XFER_MAX_ADDR ||
+		    xfers[i].length < 0 ||
+		    (xfers[i].length && !xfers[i].data))
+			return -EINVAL;
+		total += sizeof(struct hardware_cmd) + xfers[i].length;
+		any_read |= xfers[i].read;
+	}
+
+	t = kcalloc(count, sizeof(*t), GFP_KERNEL);
+	tx = kzalloc(total, GFP_KERNEL);
+	rx = any_read ? kmalloc(total, GFP_KERNEL) : NULL;
+	if (!t || !tx || (any_read && !rx)) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	matrixio_xfer_pack(xfers, count, tx, rx, t);
+
+	spi_message_init_with_transfers(&m, t, count);
+
+	mutex_lock(&matrixio->reg_lock);
+	ret = spi_sync(matrixio->spi, &m);
+	mutex_unlock(&matrixio->reg_lock);
+
+	if (!ret)
+		matrixio_xfer_unpack(xfers, count, rx);
+
+out:
+	kfree(rx);
+	kfree(tx);
+	kfree(t);
+	return ret;
+}
+EXPORT_SYMBOL(matrixio_xfer_batch);
+
 static int matrixio_reg_read(void *context, unsigned int reg, unsigned int *val)
 {
-	return matrixio_read((struct matrixio *)(context), reg, sizeof(int16_t),
-			     &val);
+	uint16_t data;
+	int ret;
+
+	ret = matrixio_read((struct matrixio *)(context), reg, sizeof(data),
+			    &data);
+	if (!ret)
+		*val = data;
+	return ret;
 }
 
 int matrixio_reg_write(void *context, unsigned int reg, unsigned int val)
@@ -158,6 +280,103 @@ int matrixio_reg_write(void *context, unsigned int reg, unsigned int val)
 }
 EXPORT_SYMBOL(matrixio_reg_write);
 
+/* Called by the drivers owning FPGA interrupts, from any context */
+void matrixio_notify_event(struct matrixio *matrixio, unsigned int event)
+{
+	atomic_inc(&matrixio->events[event]);
+	wake_up_interruptible(&matrixio->event_wait);
+
+#if IS_ENABLED(CONFIG_IIO_TRIGGER)
+	/* Mic fragments are signalled from the hard interrupt handler */
+	if (event == MATRIXIO_EVENT_MIC_FRAGMENT &&
+	    READ_ONCE(matrixio->fragment_trig_on))
+		iio_trigger_poll(matrixio->fragment_trig);
+#endif
+}
+EXPORT_SYMBOL(matrixio_notify_event);
+
+/* Tee samples written to the playback FIFO into the loopback ring.  queued is
+ * the number of frames already waiting in the FPGA FIFO ahead of these ones.
+ */
+void matrixio_loopback_push(struct matrixio *matrixio, const void *frames,
+			    unsigned int count, unsigned int queued)
+{
+	struct matrixio_loopback *lb = &matrixio->loopback;
+	const u32 *src = frames;
+	unsigned long flags;
+	u64 start;
+	unsigned int i;
+
+	spin_lock_irqsave(&lb->lock, flags);
+
+	/* Everything teed so far has been consumed, or this is the first push.
+	 * These frames will be heard once the queued ones are out, so leave
+	 * silence up to there. */
+	if (lb->head <= lb->tail) {
+		start = lb->tail + queued;
+		for (i = 0; i < min_t(u64, start - lb->tail,
+				      MATRIXIO_LOOPBACK_FRAMES);
+		     i++)
+			lb->ring[(lb->tail + i) & (MATRIXIO_LOOPBACK_FRAMES - 1)] =
+			    0;
+		lb->head = start;
+	}
+
+	for (i = 0; i < count; i++)
+		lb->ring[(lb->head + i) & (MATRIXIO_LOOPBACK_FRAMES - 1)] =
+		    src[i];
+	lb->head += count;
+	lb->lag = queued + count;
+
+	spin_unlock_irqrestore(&lb->lock, flags);
+}
+EXPORT_SYMBOL(matrixio_loopback_push);
+
+/* Align the capture side with whatever the FPGA is playing right now */
+void matrixio_loopback_sync(struct matrixio *matrixio)
+{
+	struct matrixio_loopback *lb = &matrixio->loopback;
+	unsigned long flags;
+
+	spin_lock_irqsave(&lb->lock, flags);
+	lb->tail = lb->head > lb->lag ? lb->head - lb->lag : lb->head;
+	spin_unlock_irqrestore(&lb->lock, flags);
+}
+EXPORT_SYMBOL(matrixio_loopback_sync);
+
+/* Consume count frames of reference signal, deinterleaved into two planes.
+ * Frames that were never played, or were overwritten, read as silence.  */
+void matrixio_loopback_pull(struct matrixio *matrixio, uint16_t *left,
+			    uint16_t *right, unsigned int count)
+{
+	struct matrixio_loopback *lb = &matrixio->loopback;
+	unsigned long flags;
+	unsigned int i;
+	u64 pos;
+	u16 frame[2];
+
+	spin_lock_irqsave(&lb->lock, flags);
+	for (i = 0; i < count; i++) {
+		pos = lb->tail + i;
+		if (pos < lb->head && lb->head - pos <= MATRIXIO_LOOPBACK_FRAMES)
+			memcpy(frame,
+			       &lb->ring[pos & (MATRIXIO_LOOPBACK_FRAMES - 1)],
+			       sizeof(frame));
+		else
+			memset(frame, 0, sizeof(frame));
+		left[i] = frame[0];
+		right[i] = frame[1];
+	}
+	lb->tail += count;
+	spin_unlock_irqrestore(&lb->lock, flags);
+}
+EXPORT_SYMBOL(matrixio_loopback_pull);
+
+/* UART blocks get their FPGA address as a resource so more can be listed */
+static const struct resource matrixio_uart_resources[] = {
+    DEFINE_RES_REG(MATRIXIO_UART_BASE, 0x200),
+};
+
 static int matrixio_register_devices(struct matrixio *matrixio)
 {
 	const struct mfd_cell cells[] = {
@@ -190,6 +409,8 @@ static int matrixio_register_devices(struct matrixio *matrixio)
 		.of_compatible = "matrixio-uart",
 		.platform_data = matrixio,
 		.pdata_size = sizeof(*matrixio),
+		.resources = matrixio_uart_resources,
+		.num_resources = ARRAY_SIZE(matrixio_uart_resources),
 	    },
 	    {
 		.name = "matrixio-gpio",
@@ -197,6 +418,12 @@ static int matrixio_register_devices(struct matrixio *matrixio)
 		.platform_data = matrixio,
 		.pdata_size = sizeof(*matrixio),
 	    },
+	    {
+		.name = "matrixio-pwm",
+		.of_compatible = "matrixio-pwm",
+		.platform_data = matrixio,
+		.pdata_size = sizeof(*matrixio),
+	    },
 	    {
 		.name = "matrixio-env",
 		.of_compatible = "matrixio-env",
@@ -220,6 +447,208 @@ static int matrixio_register_devices(struct matrixio *matrixio)
 				    NULL, 0, NULL);
 }
 
+#define MATRIXIO_OSC_CLOCK 50000000
+
+static void matrixio_read_id(struct matrixio *matrixio)
+{
+	u32 id;
+
+	if (matrixio_read(matrixio, MATRIXIO_CONF_BASE, sizeof(id), &id)) {
+		dev_warn(matrixio->dev, "Could not read the FPGA identifier\n");
+		return;
+	}
+
+	if (id != MATRIXIO_FPGA_CREATOR && id != MATRIXIO_FPGA_VOICE)
+		dev_warn(matrixio->dev, "Unknown FPGA identifier %#x\n", id);
+
+	matrixio->fpga_id = id;
+}
+
+/* The FPGA reports its system clock as a {divisor, multiplier} pair applied
+ * to the 50 MHz board oscillator. The PWM driver derives its prescaler and
+ * period from the result in fpga_clock. */
+static void matrixio_read_clock(struct matrixio *matrixio)
+{
+	uint16_t ratio[2];
+	int ret;
+
+	ret = matrixio_read(matrixio, MATRIXIO_CONF_BASE + 4, sizeof(ratio),
+			    ratio);
+
+	if (ret || !ratio[0] || !ratio[1]) {
+		dev_warn(matrixio->dev,
+			 "Could not read FPGA clock, assuming %d Hz\n",
+			 MATRIXIO_OSC_CLOCK);
+		matrixio->fpga_clock = MATRIXIO_OSC_CLOCK;
+		return;
+	}
+
+	matrixio->fpga_clock =
+	    div_u64((u64)MATRIXIO_OSC_CLOCK * ratio[1], ratio[0]);
+}
+
+#if IS_ENABLED(CONFIG_IIO_TRIGGER)
+
+#define MATRIXIO_TRIG_DEFAULT_HZ 100
+/* Ten times the fastest sensor rate, and far from a period short enough
+ * for the timer interrupt to starve the CPU */
+#define MATRIXIO_TRIG_MAX_HZ 2000
+
+static enum hrtimer_restart matrixio_trig_timer(struct hrtimer *timer)
+{
+	struct matrixio *matrixio =
+	    container_of(timer, struct matrixio, trig_timer);
+
+	hrtimer_forward_now(timer, matrixio->trig_period);
+	iio_trigger_poll(matrixio->hrtimer_trig);
+
+	return HRTIMER_RESTART;
+}
+
+static int matrixio_trig_hrtimer_set_state(struct iio_trigger *trig,
+					   bool state)
+{
+	struct matrixio *matrixio = iio_trigger_get_drvdata(trig);
+
+	if (state)
+		hrtimer_start(&matrixio->trig_timer, matrixio->trig_period,
+			      HRTIMER_MODE_REL);
+	else
+		hrtimer_cancel(&matrixio->trig_timer);
+
+	return 0;
+}
+
+static const struct iio_trigger_ops matrixio_trig_hrtimer_ops = {
+    .set_trigger_state = matrixio_trig_hrtimer_set_state,
+};
+
+static ssize_t sampling_frequency_show(struct device *dev,
+				       struct device_attribute *attr, char *buf)
+{
+	struct matrixio *matrixio =
+	    iio_trigger_get_drvdata(to_iio_trigger(dev));
+
+	return sysfs_emit(buf, "%llu\n",
+			  div64_u64(NSEC_PER_SEC,
+				    ktime_to_ns(READ_ONCE(matrixio->trig_period))));
+}
+
+/* Takes effect from the next tick when the trigger is running */
+static ssize_t sampling_frequency_store(struct device *dev,
+					struct device_attribute *attr,
+					const char *buf, size_t len)
+{
+	struct matrixio *matrixio =
+	    iio_trigger_get_drvdata(to_iio_trigger(dev));
+	unsigned int hz;
+	int ret;
+
+	ret = kstrtouint(buf, 10, &hz);
+	if (ret)
+		return ret;
+
+	if (!hz || hz > MATRIXIO_TRIG_MAX_HZ)
+		return -EINVAL;
+
+	WRITE_ONCE(matrixio->trig_period, ns_to_ktime(NSEC_PER_SEC / hz));
+
+	return len;
+}
+
+static DEVICE_ATTR_RW(sampling_frequency);
+
+static struct attribute *matrixio_trig_hrtimer_attrs[] = {
+    &dev_attr_sampling_frequency.attr, NULL};
+
+static const struct attribute_group matrixio_trig_hrtimer_group = {
+    .attrs = matrixio_trig_hrtimer_attrs,
+};
+
+static const struct attribute_group *matrixio_trig_hrtimer_groups[] = {
+    &matrixio_trig_hrtimer_group, NULL};
+
+static int matrixio_trig_fragment_set_state(struct iio_trigger *trig,
+					    bool state)
+{
+	struct matrixio *matrixio = iio_trigger_get_drvdata(trig);
+
+	WRITE_ONCE(matrixio->fragment_trig_on, state);
+
+	return 0;
+}
+
+static const struct iio_trigger_ops matrixio_trig_fragment_ops = {
+    .set_trigger_state = matrixio_trig_fragment_set_state,
+};
+
+static void matrixio_trig_stop(void *data)
+{
+	struct matrixio *matrixio = data;
+
+	hrtimer_cancel(&matrixio->trig_timer);
+	WRITE_ONCE(matrixio->fragment_trig_on, false);
+}
+
+/* A free running trigger at a settable rate, and one that fires on every mic
+ * fragment interrupt (only while a capture stream is running) so that motion
+ * samples can be lined up with audio. */
+static int matrixio_register_triggers(struct matrixio *matrixio)
+{
+	struct device *dev = matrixio->dev;
+	struct iio_trigger *trig;
+	int ret;
+
+	hrtimer_init(&matrixio->trig_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	matrixio->trig_timer.function = matrixio_trig_timer;
+	matrixio->trig_period =
+	    ns_to_ktime(NSEC_PER_SEC / MATRIXIO_TRIG_DEFAULT_HZ);
+
+	ret = devm_add_action_or_reset(dev, matrixio_trig_stop, matrixio);
+	if (ret)
+		return ret;
+
+	trig = devm_iio_trigger_alloc(dev, "matrixio-%s-hrtimer",
+				      dev_name(dev));
+	if (!trig)
+		return -ENOMEM;
+
+	trig->ops = &matrixio_trig_hrtimer_ops;
+	trig->dev.groups = matrixio_trig_hrtimer_groups;
+	iio_trigger_set_drvdata(trig, matrixio);
+
+	ret = devm_iio_trigger_register(dev, trig);
+	if (ret)
+		return ret;
+
+	matrixio->hrtimer_trig = trig;
+
+	trig = devm_iio_trigger_alloc(dev, "matrixio-%s-fragment",
+				      dev_name(dev));
+	if (!trig)
+		return -ENOMEM;
+
+	trig->ops = &matrixio_trig_fragment_ops;
+	iio_trigger_set_drvdata(trig, matrixio);
+
+	ret = devm_iio_trigger_register(dev, trig);
+	if (ret)
+		return ret;
+
+	matrixio->fragment_trig = trig;
+
+	return 0;
+}
+
+#else
+
+static int matrixio_register_triggers(struct matrixio *matrixio)
+{
+	return 0;
+}
+
+#endif
+
 static int matrixio_init(struct matrixio *matrixio,
 			 struct matrixio_platform_data *pdata)
 {
@@ -227,6 +656,17 @@ static int matrixio_init(struct matrixio *matrixio,
 
 	dev_set_drvdata(matrixio->dev, matrixio);
 
+	matrixio_read_id(matrixio);
+	matrixio_read_clock(matrixio);
+
+	ret = matrixio_register_triggers(matrixio);
+
+	if (ret) {
+		dev_err(matrixio->dev, "Failed to register IIO triggers: %d\n",
+			ret);
+		return ret;
+	}
+
 	/* TODO: Check that this is actually a MATRIX FPGA */
 	ret = matrixio_register_devices(matrixio);
 
@@ -267,6 +707,15 @@ static int matrixio_core_probe(struct spi_device *spi)
 	matrixio->spi = spi;
 
 	mutex_init(&matrixio->reg_lock);
+	mutex_init(&matrixio->gpio_lock);
+	init_waitqueue_head(&matrixio->event_wait);
+
+	spin_lock_init(&matrixio->loopback.lock);
+	matrixio->loopback.ring =
+	    devm_kcalloc(&spi->dev, MATRIXIO_LOOPBACK_FRAMES,
+			 sizeof(*matrixio->loopback.ring), GFP_KERNEL);
+	if (matrixio->loopback.ring == NULL)
+		return -ENOMEM;
 
 	matrixio->rx_buffer = devm_kzalloc(&spi->dev, MATRIXIO_SPI_BOUNCE_SIZE, GFP_KERNEL);
 	if (matrixio->rx_buffer == NULL)
@@ -15,12 +15,21 @@
 #ifndef __MATRIXIO_CORE_H__
 #define __MATRIXIO_CORE_H__
 
+#include <linux/hrtimer.h>
 #include <linux/kfifo.h>
 #include <linux/mutex.h>
 #include <linux/regmap.h>
 #include <linux/spi/spi.h>
+#include <linux/wait.h>
+
+#include "matrixio-compat.h"
+#include "matrixio-ioctl.h"
 
 #define MATRIXIO_CONF_BASE 0x0000
+
+/* Board identifiers at the start of MATRIXIO_CONF_BASE */
+#define MATRIXIO_FPGA_CREATOR 0x05c344e8
+#define MATRIXIO_FPGA_VOICE 0x6032bad2
 #define MATRIXIO_UART_BASE 0x1000
 #define MATRIXIO_MICARRAY_BASE 0x2000
 #define MATRIXIO_EVERLOOP_BASE 0x3000
@@ -28,6 +37,24 @@
 #define MATRIXIO_MCU_BASE 0x5000
 #define MATRIXIO_PLAYBACK_BASE 0x6000
 
+/* Size of the playback loopback ring in stereo frames, must be a power of 2 */
+#define MATRIXIO_LOOPBACK_FRAMES 8192u
+
+/* Copy of the samples sent to MATRIXIO_PLAYBACK_BASE, used by the mic driver
+ * as an echo cancellation reference.  Positions are absolute frame counts on
+ * the capture timeline: tail is the next frame the mic driver will consume,
+ * head is the frame at which the next teed sample will leave the FPGA.  */
+struct matrixio_loopback {
+	spinlock_t lock;
+	u32 *ring;	   /* One stereo S16 frame per entry */
+	u64 head;
+	u64 tail;
+	unsigned int lag; /* Frames in the FPGA FIFO after the last push */
+};
+
+struct iio_trigger;
+struct matrixio_gpio;
+
 struct matrixio {
 	struct device *dev;
 	struct regmap *regmap;
@@ -35,6 +62,33 @@ struct matrixio {
 	struct spi_device *spi;
 	u8 *tx_buffer;
 	u8 *rx_buffer;
+	struct matrixio_loopback loopback;
+	atomic_t mic_level; /* RMS of the last mic fragment, channel 0 */
+	atomic_t events[MATRIXIO_EVENT_MAX]; /* Times each event fired */
+	wait_queue_head_t event_wait;
+	u32 fpga_id; /* MATRIXIO_FPGA_*, 0 if it could not be read */
+	unsigned int fpga_clock; /* Hz, the clock the FPGA peripherals run at */
+	/* IIO triggers offered to the sensor drivers, NULL without IIO */
+	struct iio_trigger *hrtimer_trig;
+	struct iio_trigger *fragment_trig;
+	struct hrtimer trig_timer;
+	ktime_t trig_period;
+	bool fragment_trig_on;
+	/* matrixio-gpio while it is bound, it owns the GPIO bank's direction
+	 * and output registers. Protected by gpio_lock. */
+	struct mutex gpio_lock;
+	struct matrixio_gpio *gpio;
+};
+
+/* The bus command word leaves 15 bits for the address */
+#define MATRIXIO_XFER_MAX_ADDR 0x7fff
+
+/* One access for matrixio_xfer_batch() */
+struct matrixio_xfer {
+	unsigned int add;
+	int length;
+	void *data;
+	bool read;
 };
 
 struct matrixio_platform_data {
@@ -50,4 +104,27 @@ int matrixio_read(struct matrixio *matrixio, unsigned int add, int length,
 int matrixio_write(struct matrixio *matrixio, unsigned int add, int length,
 		   void *data);
 
+int matrixio_xfer_batch(struct matrixio *matrixio,
+			struct matrixio_xfer *xfers, int count);
+
+#if MATRIXIO_KUNIT_VISIBLE
+size_t matrixio_xfer_pack(const struct matrixio_xfer *xfers, int count,
+			  u8 *tx, u8 *rx, struct spi_transfer *t);
+void matrixio_xfer_unpack(struct matrixio_xfer *xfers, int count,
+			  const u8 *rx);
+#endif
+
+void matrixio_notify_event(struct matrixio *matrixio, unsigned int event);
+
+void matrixio_loopback_push(struct matrixio *matrixio, const void *frames,
+			    unsigned int count, unsigned int queued);
+
+void matrixio_loopback_sync(struct matrixio *matrixio);
+
+void matrixio_loopback_pull(struct matrixio *matrixio, uint16_t *left,
+			    uint16_t *right, unsigned int count);
+
+/* Provided by matrixio-gpio */
+int matrixio_gpio_set_output(struct matrixio *matrixio, unsigned int offset);
+
 #endif
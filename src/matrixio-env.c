@@ -14,7 +14,13 @@
 
 #include <linux/delay.h>
 #include <linux/err.h>
+#include <linux/iio/buffer.h>
 #include <linux/iio/iio.h>
+#include <linux/iio/trigger.h>
+#include <linux/iio/trigger_consumer.h>
+#include <linux/iio/triggered_buffer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
 #include <linux/platform_device.h>
@@ -25,11 +31,6 @@
 
 #define MATRIXIO_SRAM_OFFSET_ENV 0x0
 
-struct matrixio_bus {
-	struct matrixio *mio;
-	struct mutex lock;
-};
-
 struct matrixio_env_data {
 	int UV;
 	int altitude;
@@ -39,32 +40,173 @@ struct matrixio_env_data {
 	int temperature_hts;
 };
 
+enum matrixio_env_scan {
+	MATRIXIO_ENV_SCAN_UV,
+	MATRIXIO_ENV_SCAN_TEMP,
+	MATRIXIO_ENV_SCAN_PRESSURE,
+	MATRIXIO_ENV_SCAN_HUMIDITY,
+	MATRIXIO_ENV_SCAN_ALTITUDE,
+	MATRIXIO_ENV_SCAN_MAX,
+};
+
+#define MATRIXIO_ENV_VALUES (sizeof(struct matrixio_env_data) / sizeof(int))
+#define MATRIXIO_ENV_OVERSAMPLING_MAX 16
+
+struct matrixio_bus {
+	struct matrixio *mio;
+	struct mutex lock; /* Guards everything below */
+	/* Averaged sample, handed out again until it is 1 / samp_freq old so
+	 * that reads closer together share one SPI transaction */
+	struct matrixio_env_data cache;
+	ktime_t cache_expires;
+	bool cache_valid;
+	/* Set when a fetch reads the MCU, cleared once that sample is
+	 * buffered, so a trigger faster than samp_freq pushes no repeats */
+	bool cache_fresh;
+	int samp_freq;
+	/* The last oversampling reads of the MCU block and their sum */
+	int oversampling;
+	int history[MATRIXIO_ENV_OVERSAMPLING_MAX][MATRIXIO_ENV_VALUES];
+	s64 sum[MATRIXIO_ENV_VALUES];
+	unsigned int hist_pos;
+	unsigned int hist_len;
+	struct {
+		s32 values[MATRIXIO_ENV_SCAN_MAX];
+		s64 timestamp __aligned(8);
+	} scan;
+};
+
+static const int matrixio_env_samp_freq_avail[] = {1, 2, 5, 10};
+static const int matrixio_env_oversampling_avail[] = {1, 2, 4, 8, 16};
+
+#define MATRIXIO_ENV_SHARED                                                    \
+	(BIT(IIO_CHAN_INFO_SAMP_FREQ) | BIT(IIO_CHAN_INFO_OVERSAMPLING_RATIO))
+
+#define MATRIXIO_ENV_SCAN_TYPE                                                 \
+	{                                                                      \
+		.sign = 's', .realbits = 32, .storagebits = 32,                \
+		.endianness = IIO_LE,                                          \
+	}
+
+/* Raw values, in sysfs and in the buffer, are the MCU's fixed point numbers:
+ * thousandths of a degree, pascal, percent and metre.  _scale turns them into
+ * IIO units.  The UV intensity has no unit. */
+#define MATRIXIO_ENV_RAW (BIT(IIO_CHAN_INFO_RAW) | BIT(IIO_CHAN_INFO_SCALE))
+
 static const struct iio_chan_spec matrixio_env_channels[] = {
     {
 	.type = IIO_INTENSITY,
 	.modified = 1,
 	.channel2 = IIO_MOD_LIGHT_UV,
 	.info_mask_separate = BIT(IIO_CHAN_INFO_RAW),
+	.info_mask_shared_by_all = MATRIXIO_ENV_SHARED,
+	.info_mask_shared_by_all_available = MATRIXIO_ENV_SHARED,
+	.scan_index = MATRIXIO_ENV_SCAN_UV,
+	.scan_type = MATRIXIO_ENV_SCAN_TYPE,
     },
     {
 	.type = IIO_UVINDEX, .info_mask_separate = BIT(IIO_CHAN_INFO_PROCESSED),
+	.info_mask_shared_by_all = MATRIXIO_ENV_SHARED,
+	.info_mask_shared_by_all_available = MATRIXIO_ENV_SHARED,
+	.scan_index = -1,
     },
     {
 	.type = IIO_TEMP,
 	.modified = 1,
 	.channel2 = IIO_MOD_TEMP_OBJECT,
-	.info_mask_separate = BIT(IIO_CHAN_INFO_RAW),
+	.info_mask_separate = MATRIXIO_ENV_RAW,
+	.info_mask_shared_by_all = MATRIXIO_ENV_SHARED,
+	.info_mask_shared_by_all_available = MATRIXIO_ENV_SHARED,
+	.scan_index = MATRIXIO_ENV_SCAN_TEMP,
+	.scan_type = MATRIXIO_ENV_SCAN_TYPE,
     },
     {
-	.type = IIO_PRESSURE, .info_mask_separate = BIT(IIO_CHAN_INFO_RAW),
+	.type = IIO_PRESSURE, .info_mask_separate = MATRIXIO_ENV_RAW,
+	.info_mask_shared_by_all = MATRIXIO_ENV_SHARED,
+	.info_mask_shared_by_all_available = MATRIXIO_ENV_SHARED,
+	.scan_index = MATRIXIO_ENV_SCAN_PRESSURE,
+	.scan_type = MATRIXIO_ENV_SCAN_TYPE,
     },
     {
 	.type = IIO_HUMIDITYRELATIVE,
-	.info_mask_separate = BIT(IIO_CHAN_INFO_RAW),
+	.info_mask_separate = MATRIXIO_ENV_RAW,
+	.info_mask_shared_by_all = MATRIXIO_ENV_SHARED,
+	.info_mask_shared_by_all_available = MATRIXIO_ENV_SHARED,
+	.scan_index = MATRIXIO_ENV_SCAN_HUMIDITY,
+	.scan_type = MATRIXIO_ENV_SCAN_TYPE,
     },
     {
-	.type = IIO_DISTANCE, .info_mask_separate = BIT(IIO_CHAN_INFO_RAW),
-    }};
+	.type = IIO_DISTANCE, .info_mask_separate = MATRIXIO_ENV_RAW,
+	.info_mask_shared_by_all = MATRIXIO_ENV_SHARED,
+	.info_mask_shared_by_all_available = MATRIXIO_ENV_SHARED,
+	.scan_index = MATRIXIO_ENV_SCAN_ALTITUDE,
+	.scan_type = MATRIXIO_ENV_SCAN_TYPE,
+    },
+    IIO_CHAN_SOFT_TIMESTAMP(MATRIXIO_ENV_SCAN_MAX),
+};
+
+/* One read yields every value, the IIO core picks the channels */
+static const unsigned long matrixio_env_scan_masks[] = {
+    GENMASK(MATRIXIO_ENV_SCAN_MAX - 1, 0), 0};
+
+static void matrixio_env_reset(struct matrixio_bus *data)
+{
+	memset(data->sum, 0, sizeof(data->sum));
+	data->hist_pos = 0;
+	data->hist_len = 0;
+	data->cache_valid = false;
+}
+
+static bool matrixio_env_in_list(const int *list, int len, int val)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		if (list[i] == val)
+			return true;
+
+	return false;
+}
+
+/* Called with data->lock held. Reads the MCU block at most once per sample
+ * period and averages over the last oversampling reads. */
+static int matrixio_env_fetch(struct matrixio_bus *data)
+{
+	int raw[MATRIXIO_ENV_VALUES], avg[MATRIXIO_ENV_VALUES];
+	ktime_t now = ktime_get();
+	int *old;
+	int i, ret;
+
+	if (data->cache_valid && ktime_before(now, data->cache_expires))
+		return 0;
+
+	ret = matrixio_read(data->mio,
+			    MATRIXIO_MCU_BASE + (MATRIXIO_SRAM_OFFSET_ENV >> 1),
+			    sizeof(raw), raw);
+	if (ret)
+		return ret;
+
+	old = data->history[data->hist_pos];
+	if (data->hist_len == data->oversampling)
+		for (i = 0; i < MATRIXIO_ENV_VALUES; i++)
+			data->sum[i] -= old[i];
+	else
+		data->hist_len++;
+
+	for (i = 0; i < MATRIXIO_ENV_VALUES; i++) {
+		old[i] = raw[i];
+		data->sum[i] += raw[i];
+		avg[i] = div_s64(data->sum[i], data->hist_len);
+	}
+	memcpy(&data->cache, avg, sizeof(data->cache));
+
+	data->hist_pos = (data->hist_pos + 1) % data->oversampling;
+	data->cache_expires = ktime_add_ns(now, NSEC_PER_SEC / data->samp_freq);
+	data->cache_valid = true;
+	data->cache_fresh = true;
+
+	return 0;
+}
 
 static int matrixio_env_to_uv_index(unsigned val)
 {
@@ -86,12 +228,6 @@ static int matrixio_env_to_uv_index(unsigned val)
 	return 11; /* extreme */
 }
 
-static void matrixio_to_int_plus_micro(int data, int *val, int *val2)
-{
-	*val = data / 1000;
-	*val2 = (data % 1000) * 1000;
-}
-
 static int matrixio_env_read_raw(struct iio_dev *indio_dev,
 				 struct iio_chan_spec const *chan, int *val,
 				 int *val2, long mask)
@@ -100,12 +236,41 @@ static int matrixio_env_read_raw(struct iio_dev *indio_dev,
 	int ret;
 	struct matrixio_env_data env_data;
 
-static DEFINE_MUTEX(env_lock);
-	mutex_lock(&env_lock);
-	ret = matrixio_read(data->mio,
-			    MATRIXIO_MCU_BASE + (MATRIXIO_SRAM_OFFSET_ENV >> 1),
-			    sizeof(env_data), &env_data);
-	mutex_unlock(&env_lock);
+	switch (mask) {
+	case IIO_CHAN_INFO_SAMP_FREQ:
+		*val = data->samp_freq;
+		return IIO_VAL_INT;
+	case IIO_CHAN_INFO_OVERSAMPLING_RATIO:
+		*val = data->oversampling;
+		return IIO_VAL_INT;
+	case IIO_CHAN_INFO_SCALE:
+		switch (chan->type) {
+		case IIO_TEMP: /* millidegrees Celsius */
+		case IIO_HUMIDITYRELATIVE: /* milli percent */
+			*val = 1;
+			return IIO_VAL_INT;
+		case IIO_PRESSURE: /* kilopascal */
+			*val = 0;
+			*val2 = 1;
+			return IIO_VAL_INT_PLUS_MICRO;
+		case IIO_DISTANCE: /* metre */
+			*val = 0;
+			*val2 = 1000;
+			return IIO_VAL_INT_PLUS_MICRO;
+		default:
+			return -EINVAL;
+		}
+	default:
+		break;
+	}
+
+	mutex_lock(&data->lock);
+	ret = matrixio_env_fetch(data);
+	env_data = data->cache;
+	mutex_unlock(&data->lock);
+
+	if (ret)
+		return ret;
 
 	switch (mask) {
 	case IIO_CHAN_INFO_RAW:
@@ -114,21 +279,17 @@ static DEFINE_MUTEX(env_lock);
 			*val = env_data.UV;
 			return IIO_VAL_INT;
 		case IIO_TEMP:
-			matrixio_to_int_plus_micro(env_data.temperature_hts,
-						   val, val2);
-			return IIO_VAL_INT_PLUS_MICRO;
+			*val = env_data.temperature_hts;
+			return IIO_VAL_INT;
 		case IIO_PRESSURE:
-			matrixio_to_int_plus_micro(env_data.pressure, val,
-						   val2);
-			return IIO_VAL_INT_PLUS_MICRO;
+			*val = env_data.pressure;
+			return IIO_VAL_INT;
 		case IIO_HUMIDITYRELATIVE:
-			matrixio_to_int_plus_micro(env_data.humidity, val,
-						   val2);
-			return IIO_VAL_INT_PLUS_MICRO;
+			*val = env_data.humidity;
+			return IIO_VAL_INT;
 		case IIO_DISTANCE:
-			matrixio_to_int_plus_micro(env_data.altitude, val,
-						   val2);
-			return IIO_VAL_INT_PLUS_MICRO;
+			*val = env_data.altitude;
+			return IIO_VAL_INT;
 		default:
 			return -EINVAL;
 		}
@@ -140,8 +301,96 @@ static DEFINE_MUTEX(env_lock);
 	}
 }
 
+static irqreturn_t matrixio_env_trigger_handler(int irq, void *p)
+{
+	struct iio_poll_func *pf = p;
+	struct iio_dev *indio_dev = pf->indio_dev;
+	struct matrixio_bus *data = iio_priv(indio_dev);
+
+	mutex_lock(&data->lock);
+
+	if (!matrixio_env_fetch(data) && data->cache_fresh) {
+		data->cache_fresh = false;
+		data->scan.values[MATRIXIO_ENV_SCAN_UV] = data->cache.UV;
+		data->scan.values[MATRIXIO_ENV_SCAN_TEMP] =
+		    data->cache.temperature_hts;
+		data->scan.values[MATRIXIO_ENV_SCAN_PRESSURE] =
+		    data->cache.pressure;
+		data->scan.values[MATRIXIO_ENV_SCAN_HUMIDITY] =
+		    data->cache.humidity;
+		data->scan.values[MATRIXIO_ENV_SCAN_ALTITUDE] =
+		    data->cache.altitude;
+		iio_push_to_buffers_with_timestamp(indio_dev, &data->scan,
+						   iio_get_time_ns(indio_dev));
+	}
+
+	mutex_unlock(&data->lock);
+
+	iio_trigger_notify_done(indio_dev->trig);
+
+	return IRQ_HANDLED;
+}
+
+static int matrixio_env_write_raw(struct iio_dev *indio_dev,
+				  struct iio_chan_spec const *chan, int val,
+				  int val2, long mask)
+{
+	struct matrixio_bus *data = iio_priv(indio_dev);
+
+	switch (mask) {
+	case IIO_CHAN_INFO_SAMP_FREQ:
+		if (val2 || !matrixio_env_in_list(
+				matrixio_env_samp_freq_avail,
+				ARRAY_SIZE(matrixio_env_samp_freq_avail), val))
+			return -EINVAL;
+		mutex_lock(&data->lock);
+		data->samp_freq = val;
+		data->cache_valid = false;
+		mutex_unlock(&data->lock);
+		return 0;
+	case IIO_CHAN_INFO_OVERSAMPLING_RATIO:
+		if (val2 || !matrixio_env_in_list(
+				matrixio_env_oversampling_avail,
+				ARRAY_SIZE(matrixio_env_oversampling_avail),
+				val))
+			return -EINVAL;
+		mutex_lock(&data->lock);
+		data->oversampling = val;
+		matrixio_env_reset(data);
+		mutex_unlock(&data->lock);
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
+static int matrixio_env_read_avail(struct iio_dev *indio_dev,
+				   struct iio_chan_spec const *chan,
+				   const int **vals, int *type, int *length,
+				   long mask)
+{
+	switch (mask) {
+	case IIO_CHAN_INFO_SAMP_FREQ:
+		*vals = matrixio_env_samp_freq_avail;
+		*length = ARRAY_SIZE(matrixio_env_samp_freq_avail);
+		break;
+	case IIO_CHAN_INFO_OVERSAMPLING_RATIO:
+		*vals = matrixio_env_oversampling_avail;
+		*length = ARRAY_SIZE(matrixio_env_oversampling_avail);
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	*type = IIO_VAL_INT;
+
+	return IIO_AVAIL_LIST;
+}
+
 static const struct iio_info matrixio_env_info = {
     .read_raw = matrixio_env_read_raw,
+    .write_raw = matrixio_env_write_raw,
+    .read_avail = matrixio_env_read_avail,
     // .driver_module = THIS_MODULE,
 };
 
@@ -149,6 +398,7 @@ static int matrixio_env_probe(struct platform_device *pdev)
 {
 	struct matrixio_bus *data;
 	struct iio_dev *indio_dev;
+	int ret;
 
 	indio_dev = devm_iio_device_alloc(&pdev->dev, sizeof(*data));
 	if (!indio_dev)
@@ -161,6 +411,9 @@ static int matrixio_env_probe(struct platform_device *pdev)
 	platform_set_drvdata(pdev, indio_dev);
 
 	mutex_init(&data->lock);
+	data->samp_freq = matrixio_env_samp_freq_avail[
+	    ARRAY_SIZE(matrixio_env_samp_freq_avail) - 1];
+	data->oversampling = 1;
 
 	indio_dev->dev.parent = &pdev->dev;
 	indio_dev->info = &matrixio_env_info;
@@ -168,9 +421,22 @@ static int matrixio_env_probe(struct platform_device *pdev)
 	indio_dev->num_channels = ARRAY_SIZE(matrixio_env_channels);
 	indio_dev->name = MATRIXIO_UV_DRV_NAME;
 	indio_dev->modes = INDIO_DIRECT_MODE;
+	indio_dev->available_scan_masks = matrixio_env_scan_masks;
 
 	data->mio = dev_get_drvdata(pdev->dev.parent);
 
+	ret = devm_iio_triggered_buffer_setup(&pdev->dev, indio_dev, NULL,
+					      matrixio_env_trigger_handler,
+					      NULL);
+	if (ret) {
+		dev_err(&pdev->dev, "Failed to set up IIO buffer: %d\n", ret);
+		return ret;
+	}
+
+	/* Buffered capture runs off the core's timer trigger by default */
+	if (data->mio->hrtimer_trig)
+		indio_dev->trig = iio_trigger_get(data->mio->hrtimer_trig);
+
 	return iio_device_register(indio_dev);
 }
 
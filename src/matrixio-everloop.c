@@ -1,12 +1,40 @@
 #include "matrixio-compat.h"
 #include <linux/cdev.h>
 #include <linux/fs.h>
+#include <linux/hrtimer.h>
 #include <linux/init.h>
 #include <linux/kernel.h>
+#include <linux/led-class-multicolor.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/platform_device.h>
+#include <linux/spinlock.h>
+#include <linux/uaccess.h>
+#include <linux/workqueue.h>
 
 #include "matrixio-core.h"
+#include "matrixio-everloop.h"
+#include "matrixio-ioctl.h"
+
+/* Ring sizes of the MATRIX Creator and the MATRIX Voice, buffers are
+ * sized for the larger one */
+#define MATRIXIO_EVERLOOP_LEDS 35
+#define MATRIXIO_EVERLOOP_VOICE_LEDS 18
+#define MATRIXIO_EVERLOOP_SIZE (MATRIXIO_EVERLOOP_LEDS * 4)
+
+/* LED class updates closer together than this go out in one transfer */
+#define MATRIXIO_EVERLOOP_COALESCE_MS 5
+
+struct everloop_data;
+
+struct everloop_led {
+	struct everloop_data *el;
+	unsigned int index;
+	struct led_classdev_mc mc;
+	struct mc_subled subleds[4];
+};
 
 struct everloop_data {
 	struct matrixio *mio;
@@ -15,18 +43,433 @@ struct everloop_data {
 	struct cdev cdev;
 	struct device *device;
 	int major;
+
+	/* Writers update the framebuffer and mark what changed, the worker
+	 * sends only the dirty bytes.  Changes made while a transfer is in
+	 * flight are merged into the next one. */
+	spinlock_t lock;   /* Protects dirty */
+	u8 *fb;		   /* One page, mmap()able */
+	struct matrixio_everloop_dirty dirty;
+	u8 *front;	   /* Bytes being sent */
+	struct delayed_work work;
+	unsigned int nleds; /* LEDs on this board's ring */
+
+	/* Animation engine, renders into fb from the timer */
+	struct hrtimer timer;
+	struct matrixio_everloop_anim anim; /* Protected by lock */
+	u32 anim_period_ms;		    /* Sum of the key durations */
+	ktime_t anim_start;
+	bool anim_static; /* Renders the same frame forever, no timer needed */
+	/* Protected by lock. Cleared by every direct change to the ring, so
+	 * the timer stops instead of painting over it */
+	bool anim_running;
+
+	struct everloop_led *leds;
 };
 
+/* Caller holds el->lock */
+VISIBLE_IF_KUNIT void
+matrixio_everloop_mark_dirty(struct matrixio_everloop_dirty *dirty,
+			     size_t start, size_t end)
+{
+	if (dirty->start == dirty->end) {
+		dirty->start = start;
+		dirty->end = end;
+		return;
+	}
+	dirty->start = min(dirty->start, start);
+	dirty->end = max(dirty->end, end);
+}
+EXPORT_SYMBOL_IF_KUNIT(matrixio_everloop_mark_dirty);
+
+static void matrixio_everloop_work(struct work_struct *work)
+{
+	struct everloop_data *el =
+	    container_of(to_delayed_work(work), struct everloop_data, work);
+	unsigned long flags;
+	size_t start, end;
+	int ret;
+
+	spin_lock_irqsave(&el->lock, flags);
+	start = el->dirty.start;
+	end = el->dirty.end;
+	memcpy(el->front, el->fb + start, end - start);
+	el->dirty.start = el->dirty.end = 0;
+	spin_unlock_irqrestore(&el->lock, flags);
+
+	if (start == end)
+		return;
+
+	/* Bus addresses count 16-bit words */
+	ret = matrixio_write(el->mio, MATRIXIO_EVERLOOP_BASE + start / 2,
+			     end - start, el->front);
+	if (ret)
+		dev_err_ratelimited(el->mio->dev,
+				    "everloop frame write failed (%d)\n", ret);
+}
+
+static u8 matrixio_everloop_blend(u8 from, u8 to, u32 num, u32 den)
+{
+	if (!den)
+		return from;
+	return from + ((int)to - from) * (int)num / (int)den;
+}
+
+static void matrixio_everloop_blend_key(u8 *led,
+					const struct matrixio_everloop_key *from,
+					const struct matrixio_everloop_key *to,
+					u32 num, u32 den)
+{
+	led[0] = matrixio_everloop_blend(from->red, to->red, num, den);
+	led[1] = matrixio_everloop_blend(from->green, to->green, num, den);
+	led[2] = matrixio_everloop_blend(from->blue, to->blue, num, den);
+	led[3] = matrixio_everloop_blend(from->white, to->white, num, den);
+}
+
+/* Render one frame of the current animation into frame.  Caller holds lock. */
+static void matrixio_everloop_render(struct everloop_data *el, u8 *frame,
+				     u64 now_ms)
+{
+	const struct matrixio_everloop_anim *anim = &el->anim;
+	const struct matrixio_everloop_key *key, *next;
+	u32 t = 0, pos, turn = 0, lit, level;
+	unsigned int i, k, n = el->nleds;
+
+	/* Find the key we are in and how far into it */
+	if (el->anim_period_ms)
+		div_u64_rem(now_ms, el->anim_period_ms, &t);
+	for (k = 0; k < anim->nkeys - 1 && t >= anim->keys[k].duration_ms; k++)
+		t -= anim->keys[k].duration_ms;
+	key = &anim->keys[k];
+	next = &anim->keys[(k + 1) % anim->nkeys];
+
+	switch (anim->effect) {
+	case MATRIXIO_EVERLOOP_ANIM_FADE:
+		matrixio_everloop_blend_key(frame, key, next, t,
+					    key->duration_ms);
+		for (i = 1; i < n; i++)
+			memcpy(frame + i * 4, frame, 4);
+		break;
+	case MATRIXIO_EVERLOOP_ANIM_BREATHE:
+		/* Triangle wave, 0 -> 255 -> 0 over the key */
+		level = key->duration_ms ? 510 * t / key->duration_ms : 255;
+		if (level > 255)
+			level = 510 - level;
+		frame[0] = key->red * level / 255;
+		frame[1] = key->green * level / 255;
+		frame[2] = key->blue * level / 255;
+		frame[3] = key->white * level / 255;
+		for (i = 1; i < n; i++)
+			memcpy(frame + i * 4, frame, 4);
+		break;
+	case MATRIXIO_EVERLOOP_ANIM_ROTATE:
+		/* Ring position in 1/256 LED steps */
+		if (anim->keys[0].duration_ms) {
+			div_u64_rem(now_ms, anim->keys[0].duration_ms, &turn);
+			turn = div_u64((u64)turn * (n * 256),
+				       anim->keys[0].duration_ms);
+		}
+		for (i = 0; i < n; i++) {
+			pos = ((i * 256 + turn) % (n * 256)) * anim->nkeys;
+			k = pos / (n * 256);
+			matrixio_everloop_blend_key(
+			    frame + i * 4, &anim->keys[k],
+			    &anim->keys[(k + 1) % anim->nkeys],
+			    pos % (n * 256), n * 256);
+		}
+		break;
+	case MATRIXIO_EVERLOOP_ANIM_VU:
+		/* Full scale at about -12 dBFS, speech rarely goes above */
+		level = min(atomic_read(&el->mio->mic_level), 8192);
+		lit = level * n / 8192;
+		next = &anim->keys[anim->nkeys > 1 ? 1 : 0];
+		for (i = 0; i < n; i++) {
+			if (i < lit)
+				matrixio_everloop_blend_key(
+				    frame + i * 4, &anim->keys[0], next, i, n - 1);
+			else
+				memset(frame + i * 4, 0, 4);
+		}
+		break;
+	}
+}
+
+static enum hrtimer_restart matrixio_everloop_timer(struct hrtimer *timer)
+{
+	struct everloop_data *el =
+	    container_of(timer, struct everloop_data, timer);
+	u8 frame[MATRIXIO_EVERLOOP_SIZE];
+	bool changed, done;
+
+	spin_lock(&el->lock);
+	if (!el->anim_running) {
+		spin_unlock(&el->lock);
+		return HRTIMER_NORESTART;
+	}
+	matrixio_everloop_render(el, frame,
+				 ktime_ms_delta(ktime_get(), el->anim_start));
+	done = el->anim_static;
+	/* Static frames cost nothing once they have been sent */
+	changed = memcmp(el->fb, frame, el->nleds * 4) != 0;
+	if (changed) {
+		memcpy(el->fb, frame, el->nleds * 4);
+		matrixio_everloop_mark_dirty(&el->dirty, 0, el->nleds * 4);
+	}
+	if (!done)
+		hrtimer_forward_now(timer,
+				    ns_to_ktime(NSEC_PER_SEC / el->anim.fps));
+	spin_unlock(&el->lock);
+
+	if (changed)
+		mod_delayed_work(system_wq, &el->work, 0);
+
+	return done ? HRTIMER_NORESTART : HRTIMER_RESTART;
+}
+
+/* True if every frame of anim is the same, so one render is enough */
+static bool
+matrixio_everloop_anim_is_static(const struct matrixio_everloop_anim *anim)
+{
+	const struct matrixio_everloop_key *k0 = &anim->keys[0];
+	unsigned int i;
+
+	/* The VU meter follows the microphones */
+	if (anim->effect == MATRIXIO_EVERLOOP_ANIM_VU)
+		return false;
+
+	for (i = 1; i < anim->nkeys; i++)
+		if (anim->keys[i].red != k0->red ||
+		    anim->keys[i].green != k0->green ||
+		    anim->keys[i].blue != k0->blue ||
+		    anim->keys[i].white != k0->white)
+			return false;
+
+	/* Breathing only stands still when it is dark */
+	if (anim->effect == MATRIXIO_EVERLOOP_ANIM_BREATHE)
+		return !k0->red && !k0->green && !k0->blue && !k0->white;
+
+	return true;
+}
+
+static int matrixio_everloop_anim_start(struct everloop_data *el,
+					const struct matrixio_everloop_anim *anim)
+{
+	unsigned long flags;
+	u32 period = 0;
+	unsigned int i;
+
+	if (anim->effect > MATRIXIO_EVERLOOP_ANIM_VU || anim->fps < 1 ||
+	    anim->fps > 100 || anim->nkeys < 1 ||
+	    anim->nkeys > MATRIXIO_EVERLOOP_ANIM_KEYS_MAX)
+		return -EINVAL;
+
+	for (i = 0; i < anim->nkeys; i++) {
+		if (anim->keys[i].duration_ms > 3600 * 1000)
+			return -EINVAL;
+		period += anim->keys[i].duration_ms;
+	}
+
+	hrtimer_cancel(&el->timer);
+
+	spin_lock_irqsave(&el->lock, flags);
+	el->anim = *anim;
+	el->anim_period_ms = period;
+	el->anim_start = ktime_get();
+	el->anim_static = matrixio_everloop_anim_is_static(anim);
+	el->anim_running = true;
+	spin_unlock_irqrestore(&el->lock, flags);
+
+	hrtimer_start(&el->timer, 0, HRTIMER_MODE_REL);
+
+	return 0;
+}
+
+#if IS_ENABLED(CONFIG_LEDS_CLASS_MULTICOLOR)
+/* May be called from atomic context by triggers, so only touch the
+ * framebuffer here and leave the bus to the worker */
+static void matrixio_everloop_led_set(struct led_classdev *cdev,
+				      enum led_brightness brightness)
+{
+	struct led_classdev_mc *mc = lcdev_to_mccdev(cdev);
+	struct everloop_led *led = container_of(mc, struct everloop_led, mc);
+	struct everloop_data *el = led->el;
+	unsigned long flags;
+	unsigned int i;
+
+	led_mc_calc_color_components(mc, brightness);
+
+	spin_lock_irqsave(&el->lock, flags);
+	el->anim_running = false;
+	for (i = 0; i < ARRAY_SIZE(led->subleds); i++)
+		el->fb[led->index * 4 + i] = led->subleds[i].brightness;
+	matrixio_everloop_mark_dirty(&el->dirty, led->index * 4,
+				     led->index * 4 + 4);
+	spin_unlock_irqrestore(&el->lock, flags);
+
+	/* Does nothing if already pending, so the first change opens the
+	 * window and the rest ride along */
+	schedule_delayed_work(&el->work,
+			      msecs_to_jiffies(MATRIXIO_EVERLOOP_COALESCE_MS));
+}
+
+static int matrixio_everloop_register_leds(struct platform_device *pdev,
+					   struct everloop_data *el)
+{
+	static const int colors[] = {LED_COLOR_ID_RED, LED_COLOR_ID_GREEN,
+				     LED_COLOR_ID_BLUE, LED_COLOR_ID_WHITE};
+	struct everloop_led *led;
+	unsigned int i, c;
+	int ret;
+
+	el->leds = devm_kcalloc(&pdev->dev, el->nleds,
+				sizeof(*el->leds), GFP_KERNEL);
+	if (el->leds == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < el->nleds; i++) {
+		led = &el->leds[i];
+		led->el = el;
+		led->index = i;
+
+		for (c = 0; c < ARRAY_SIZE(colors); c++) {
+			led->subleds[c].color_index = colors[c];
+			led->subleds[c].intensity = 255;
+		}
+		led->mc.subled_info = led->subleds;
+		led->mc.num_colors = ARRAY_SIZE(led->subleds);
+
+		led->mc.led_cdev.name = devm_kasprintf(
+		    &pdev->dev, GFP_KERNEL, "matrixio:multicolor:ring-%u", i);
+		if (led->mc.led_cdev.name == NULL)
+			return -ENOMEM;
+		led->mc.led_cdev.max_brightness = 255;
+		led->mc.led_cdev.brightness_set = matrixio_everloop_led_set;
+
+		ret = devm_led_classdev_multicolor_register(&pdev->dev,
+							    &led->mc);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+#else
+static int matrixio_everloop_register_leds(struct platform_device *pdev,
+					   struct everloop_data *el)
+{
+	return 0;
+}
+#endif
+
 ssize_t matrixio_everloop_write(struct file *pfile, const char __user *buffer,
 				size_t length, loff_t *offset)
 {
 	struct everloop_data *el = pfile->private_data;
+	u8 frame[MATRIXIO_EVERLOOP_SIZE];
+	unsigned long flags;
+
+	if (length > el->nleds * 4)
+		return -EINVAL;
+
+	if (copy_from_user(frame, buffer, length))
+		return -EFAULT;
+
+	/* A short write only replaces its own LEDs, anything still pending
+	 * from an earlier, longer write keeps its extent and goes out too */
+	spin_lock_irqsave(&el->lock, flags);
+	el->anim_running = false;
+	memcpy(el->fb, frame, length);
+	matrixio_everloop_mark_dirty(&el->dirty, 0, length);
+	spin_unlock_irqrestore(&el->lock, flags);
 
-	matrixio_write(el->mio, MATRIXIO_EVERLOOP_BASE, length, (void *)buffer);
+	mod_delayed_work(system_wq, &el->work, 0);
 
 	return length;
 }
 
+static long matrixio_everloop_ioctl(struct file *pfile, unsigned int cmd,
+				    unsigned long arg)
+{
+	struct everloop_data *el = pfile->private_data;
+	struct matrixio_everloop_range range;
+	struct matrixio_everloop_anim anim;
+	unsigned long flags;
+
+	switch (cmd) {
+	case MATRIXIO_EVERLOOP_IOC_FLUSH:
+		if (copy_from_user(&range, (void __user *)arg, sizeof(range)))
+			return -EFAULT;
+
+		if (range.first >= el->nleds ||
+		    range.count > el->nleds - range.first)
+			return -EINVAL;
+
+		if (!range.count)
+			return 0;
+
+		spin_lock_irqsave(&el->lock, flags);
+		el->anim_running = false;
+		matrixio_everloop_mark_dirty(&el->dirty, range.first * 4,
+					     (range.first + range.count) * 4);
+		spin_unlock_irqrestore(&el->lock, flags);
+
+		mod_delayed_work(system_wq, &el->work, 0);
+		return 0;
+
+	case MATRIXIO_EVERLOOP_IOC_ANIM_START:
+		if (copy_from_user(&anim, (void __user *)arg, sizeof(anim)))
+			return -EFAULT;
+
+		return matrixio_everloop_anim_start(el, &anim);
+
+	case MATRIXIO_EVERLOOP_IOC_ANIM_STOP:
+		spin_lock_irqsave(&el->lock, flags);
+		el->anim_running = false;
+		spin_unlock_irqrestore(&el->lock, flags);
+		hrtimer_cancel(&el->timer);
+		return 0;
+	}
+	return -ENOTTY;
+}
+
+static int matrixio_everloop_mmap(struct file *pfile,
+				  struct vm_area_struct *vma)
+{
+	struct everloop_data *el = pfile->private_data;
+
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start > PAGE_SIZE)
+		return -EINVAL;
+
+	/* A private mapping would copy the page on the first store, and the
+	 * frame would never see it */
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+	/* vm_insert_page() holds a page reference, so the mapping stays valid
+	 * even if the driver is unbound first */
+	return vm_insert_page(vma, vma->vm_start, virt_to_page(el->fb));
+}
+
+/* msync() and fsync() push the whole mapped frame, like a FLUSH of every
+ * LED, and return once it has been sent.  Like any direct change they end
+ * a running animation. */
+static int matrixio_everloop_fsync(struct file *pfile, loff_t start,
+				   loff_t end, int datasync)
+{
+	struct everloop_data *el = pfile->private_data;
+	unsigned long flags;
+
+	spin_lock_irqsave(&el->lock, flags);
+	el->anim_running = false;
+	matrixio_everloop_mark_dirty(&el->dirty, 0, el->nleds * 4);
+	spin_unlock_irqrestore(&el->lock, flags);
+
+	mod_delayed_work(system_wq, &el->work, 0);
+	flush_delayed_work(&el->work);
+
+	return 0;
+}
+
 int matrixio_everloop_open(struct inode *inode, struct file *filp)
 {
 
@@ -41,7 +484,10 @@ int matrixio_everloop_open(struct inode *inode, struct file *filp)
 struct file_operations matrixio_everloop_file_operations = {
     .owner = THIS_MODULE,
     .open = matrixio_everloop_open,
-    .write = matrixio_everloop_write};
+    .write = matrixio_everloop_write,
+    .unlocked_ioctl = matrixio_everloop_ioctl,
+    .mmap = matrixio_everloop_mmap,
+    .fsync = matrixio_everloop_fsync};
 
 static int matrixio_everloop_uevent(struct device *dev, struct kobj_uevent_env *env)
 {
@@ -50,9 +496,18 @@ static int matrixio_everloop_uevent(struct device *dev, struct kobj_uevent_env *
 	return 0;
 }
 
+static void matrixio_everloop_stop(void *data)
+{
+	struct everloop_data *el = data;
+
+	hrtimer_cancel(&el->timer);
+	cancel_delayed_work_sync(&el->work);
+}
+
 static int matrixio_everloop_probe(struct platform_device *pdev)
 {
 	struct everloop_data *el;
+	int ret;
 
 	el = devm_kzalloc(&pdev->dev, sizeof(struct everloop_data), GFP_KERNEL);
 
@@ -63,30 +518,79 @@ static int matrixio_everloop_probe(struct platform_device *pdev)
 
 	el->mio = dev_get_drvdata(pdev->dev.parent);
 
-	alloc_chrdev_region(&el->devt, 0, 1, "matrixio_everloop");
-	el->cl = MATRIXIO_CLASS_CREATE("matrixio_everloop");
+	el->front = devm_kzalloc(&pdev->dev, MATRIXIO_EVERLOOP_SIZE, GFP_KERNEL);
+	if (el->front == NULL)
+		return -ENOMEM;
+
+	el->fb = (u8 *)devm_get_free_pages(&pdev->dev, GFP_KERNEL | __GFP_ZERO,
+					   0);
+	if (el->fb == NULL)
+		return -ENOMEM;
+
+	el->nleds = el->mio->fpga_id == MATRIXIO_FPGA_VOICE
+			? MATRIXIO_EVERLOOP_VOICE_LEDS
+			: MATRIXIO_EVERLOOP_LEDS;
+
+	spin_lock_init(&el->lock);
+	INIT_DELAYED_WORK(&el->work, matrixio_everloop_work);
+	hrtimer_init(&el->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	el->timer.function = matrixio_everloop_timer;
+
+	/* Registered before the LEDs so it runs after they are turned off */
+	ret = devm_add_action_or_reset(&pdev->dev, matrixio_everloop_stop, el);
+	if (ret)
+		return ret;
+
+	/* The character device is only exposed once nothing else can fail */
+	ret = matrixio_everloop_register_leds(pdev, el);
+	if (ret)
+		return ret;
 
+	ret = alloc_chrdev_region(&el->devt, 0, 1, "matrixio_everloop");
+	if (ret)
+		return ret;
+
+	el->cl = MATRIXIO_CLASS_CREATE("matrixio_everloop");
+	if (IS_ERR(el->cl)) {
+		ret = PTR_ERR(el->cl);
+		goto err_region;
+	}
 	el->cl->dev_uevent = MATRIXIO_UEVENT_CAST(matrixio_everloop_uevent);
 
+	cdev_init(&el->cdev, &matrixio_everloop_file_operations);
+	ret = cdev_add(&el->cdev, el->devt, 1);
+	if (ret)
+		goto err_class;
+
 	el->device =
 	    device_create(el->cl, NULL, el->devt, NULL, "matrixio_everloop");
-
 	if (IS_ERR(el->device)) {
+		ret = PTR_ERR(el->device);
 		dev_err(&pdev->dev, "Unable to create device "
-				    "for matrix; errno = %ld\n",
-			PTR_ERR(el->device));
+				    "for matrix; errno = %d\n",
+			ret);
+		goto err_cdev;
 	}
-	cdev_init(&el->cdev, &matrixio_everloop_file_operations);
-	cdev_add(&el->cdev, el->devt, 1);
 
 	return 0;
+
+err_cdev:
+	cdev_del(&el->cdev);
+err_class:
+	class_destroy(el->cl);
+err_region:
+	unregister_chrdev_region(el->devt, 1);
+	return ret;
 }
 
 static MATRIXIO_REMOVE_RETURN_TYPE matrixio_everloop_remove(struct platform_device *pdev)
 {
 	struct everloop_data *el = dev_get_drvdata(&pdev->dev);
 
-	unregister_chrdev(el->major, "matrixio_everloop");
+	device_destroy(el->cl, el->devt);
+	cdev_del(&el->cdev);
+	class_destroy(el->cl);
+	unregister_chrdev_region(el->devt, 1);
 
 	MATRIXIO_REMOVE_RETURN();
 }
@@ -0,0 +1,17 @@
+#ifndef __MATRIXIO_EVERLOOP_H__
+#define __MATRIXIO_EVERLOOP_H__
+
+#include "matrixio-core.h"
+
+/* Byte range of the framebuffer not yet sent, empty when start == end */
+struct matrixio_everloop_dirty {
+	size_t start;
+	size_t end;
+};
+
+#if MATRIXIO_KUNIT_VISIBLE
+void matrixio_everloop_mark_dirty(struct matrixio_everloop_dirty *dirty,
+				  size_t start, size_t end);
+#endif
+
+#endif
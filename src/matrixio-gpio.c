@@ -1,9 +1,19 @@
 #include "matrixio-compat.h"
 #include <linux/bitops.h>
+#include <linux/cdev.h>
 #include <linux/fs.h>
+#include <linux/hrtimer.h>
 #include <linux/init.h>
+#include <linux/interrupt.h>
+#include <linux/irq.h>
+#include <linux/kfifo.h>
+#include <linux/kthread.h>
 #include <linux/module.h>
+#include <linux/of_irq.h>
 #include <linux/platform_device.h>
+#include <linux/poll.h>
+#include <linux/sched.h>
+#include <linux/workqueue.h>
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
 #include <linux/gpio/driver.h>
 #else
@@ -12,95 +22,698 @@
 
 #include "matrixio-core.h"
 
+#define MATRIXIO_GPIO_DIR MATRIXIO_GPIO_BASE
+#define MATRIXIO_GPIO_VALUE (MATRIXIO_GPIO_BASE + 1)
+
 struct matrixio_gpio {
 	struct gpio_chip chip;
 	struct matrixio *mio;
 	struct mutex lock;
+	/* Shadows of the direction and output registers, which only this
+	 * driver writes. Both are read back once at probe. */
+	u16 dir;
+	u16 out;
+
+	/* Software interrupt controller. The FPGA only exposes levels, so
+	 * edges are found by diffing the value register against the last
+	 * scan, either when the parent interrupt fires or, without one, on
+	 * a poll timer. Trigger settings are staged under irq_lock while the
+	 * irq core holds the bus lock and committed under lock on unlock. */
+	struct mutex irq_lock;
+	u16 irq_enabled, irq_rising, irq_falling, irq_high, irq_low;
+	u16 next_enabled, next_rising, next_falling, next_high, next_low;
+	u16 last;
+	int parent_irq;
+	struct delayed_work poll;
+
+	struct matrixio_gpio_wave *wave;
 };
 
+#define MATRIXIO_GPIO_POLL_MS 10
+
+#define MATRIXIO_GPIO_WAVE_STEPS 4096
+
+/* Waveform player behind /dev/matrixio_gpio_wave. write() is the only
+ * producer and the thread the only consumer of the step queue. */
+struct matrixio_gpio_wave {
+	struct matrixio_gpio *gpio;
+	DECLARE_KFIFO(fifo, struct matrixio_gpio_step, MATRIXIO_GPIO_WAVE_STEPS);
+	struct mutex write_lock; /* One writer at a time */
+	wait_queue_head_t data_wait; /* Steps were queued */
+	wait_queue_head_t room_wait; /* Steps were played */
+	struct task_struct *thread;
+	atomic_t cancel;
+	bool busy; /* Thread is between taking steps and playing them */
+
+	struct class *cl;
+	dev_t devt;
+	struct cdev cdev;
+	struct device *device;
+};
+
+static int matrixio_gpio_write(struct matrixio_gpio *chip, unsigned int reg,
+			       u16 value)
+{
+	return matrixio_write(chip->mio, reg, sizeof(value), &value);
+}
+
+/* Output lines are answered from the shadow, only inputs touch the bus */
+static int matrixio_gpio_read(struct matrixio_gpio *chip, unsigned long mask,
+			      unsigned long *bits)
+{
+	u16 value = 0;
+	int ret;
+
+	if (mask & ~chip->dir) {
+		ret = matrixio_read(chip->mio, MATRIXIO_GPIO_VALUE,
+				    sizeof(value), &value);
+		if (ret)
+			return ret;
+	}
+
+	*bits = ((value & ~chip->dir) | (chip->out & chip->dir)) & mask;
+
+	return 0;
+}
+
 static int matrixio_gpio_get_direction(struct gpio_chip *gc, unsigned offset)
 {
 	struct matrixio_gpio *chip = gpiochip_get_data(gc);
-	int gpio_direction;
+	int ret;
 
 	mutex_lock(&chip->lock);
-	regmap_read(chip->mio->regmap, MATRIXIO_GPIO_BASE, &gpio_direction);
+	ret = chip->dir & BIT(offset) ? GPIO_LINE_DIRECTION_OUT
+				      : GPIO_LINE_DIRECTION_IN;
 	mutex_unlock(&chip->lock);
 
-	return (gpio_direction & BIT(offset));
+	return ret;
 }
 
 static int matrixio_gpio_direction_input(struct gpio_chip *gc, unsigned offset)
 {
 	struct matrixio_gpio *chip = gpiochip_get_data(gc);
-	int gpio_direction;
+	int ret;
 
 	mutex_lock(&chip->lock);
-	regmap_read(chip->mio->regmap, MATRIXIO_GPIO_BASE, &gpio_direction);
-
-	gpio_direction &= ~BIT(offset);
-
-	regmap_write(chip->mio->regmap, MATRIXIO_GPIO_BASE, gpio_direction);
+	ret = matrixio_gpio_write(chip, MATRIXIO_GPIO_DIR,
+				  chip->dir & ~BIT(offset));
+	if (!ret)
+		chip->dir &= ~BIT(offset);
 	mutex_unlock(&chip->lock);
 
-	MATRIXIO_REMOVE_RETURN();
+	return ret;
 }
 
 static int matrixio_gpio_direction_output(struct gpio_chip *gc, unsigned offset,
 					  int value)
 {
 	struct matrixio_gpio *chip = gpiochip_get_data(gc);
-	int gpio_direction;
-	int gpio_value;
+	u16 out;
+	int ret;
 
 	mutex_lock(&chip->lock);
 
-	regmap_read(chip->mio->regmap, MATRIXIO_GPIO_BASE, &gpio_direction);
-	regmap_read(chip->mio->regmap, MATRIXIO_GPIO_BASE + 1, &gpio_value);
-
-	if (value)
-		gpio_value |= BIT(offset);
-	else
-		gpio_value &= ~BIT(offset);
+	out = value ? chip->out | BIT(offset) : chip->out & ~BIT(offset);
 
-	gpio_direction |= BIT(offset);
+	/* Latch the level first so the line never glitches to a stale one */
+	ret = matrixio_gpio_write(chip, MATRIXIO_GPIO_VALUE, out);
+	if (!ret) {
+		chip->out = out;
+		ret = matrixio_gpio_write(chip, MATRIXIO_GPIO_DIR,
+					  chip->dir | BIT(offset));
+	}
+	if (!ret)
+		chip->dir |= BIT(offset);
 
-	regmap_write(chip->mio->regmap, MATRIXIO_GPIO_BASE, gpio_direction);
-	regmap_write(chip->mio->regmap, MATRIXIO_GPIO_BASE + 1, gpio_value);
 	mutex_unlock(&chip->lock);
 
-	MATRIXIO_REMOVE_RETURN();
+	return ret;
 }
 
 static int matrixio_gpio_get(struct gpio_chip *gc, unsigned offset)
 {
 	struct matrixio_gpio *chip = gpiochip_get_data(gc);
-	int gpio_value;
+	unsigned long bits;
+	int ret;
+
+	mutex_lock(&chip->lock);
+	ret = matrixio_gpio_read(chip, BIT(offset), &bits);
+	mutex_unlock(&chip->lock);
+
+	if (ret)
+		return ret;
+
+	return !!bits;
+}
+
+static int matrixio_gpio_get_multiple(struct gpio_chip *gc, unsigned long *mask,
+				      unsigned long *bits)
+{
+	struct matrixio_gpio *chip = gpiochip_get_data(gc);
+	int ret;
 
 	mutex_lock(&chip->lock);
-	regmap_read(chip->mio->regmap, MATRIXIO_GPIO_BASE + 1, &gpio_value);
+	ret = matrixio_gpio_read(chip, *mask, bits);
 	mutex_unlock(&chip->lock);
 
-	return (gpio_value & BIT(offset));
+	return ret;
 }
 
-static void matrixio_gpio_set(struct gpio_chip *gc, unsigned offset, int value)
+static void matrixio_gpio_set_multiple(struct gpio_chip *gc,
+				       unsigned long *mask, unsigned long *bits)
 {
 	struct matrixio_gpio *chip = gpiochip_get_data(gc);
-	int gpio_value;
+	u16 out;
 
 	mutex_lock(&chip->lock);
-	regmap_read(chip->mio->regmap, MATRIXIO_GPIO_BASE + 1, &gpio_value);
 
-	if (value)
-		gpio_value |= BIT(offset);
-	else
-		gpio_value &= ~BIT(offset);
+	out = (chip->out & ~*mask) | (*bits & *mask);
+
+	/* The whole bank goes out in one write, skip it if nothing changes */
+	if (out != chip->out &&
+	    !matrixio_gpio_write(chip, MATRIXIO_GPIO_VALUE, out))
+		chip->out = out;
 
-	regmap_write(chip->mio->regmap, MATRIXIO_GPIO_BASE + 1, gpio_value);
 	mutex_unlock(&chip->lock);
 }
 
+static void matrixio_gpio_set(struct gpio_chip *gc, unsigned offset, int value)
+{
+	unsigned long mask = BIT(offset);
+	unsigned long bits = value ? mask : 0;
+
+	matrixio_gpio_set_multiple(gc, &mask, &bits);
+}
+
+/* Lets other drivers on the bank, like matrixio-pwm, make a line an output
+ * without going behind the direction shadow. The level is left alone. */
+int matrixio_gpio_set_output(struct matrixio *mio, unsigned int offset)
+{
+	struct matrixio_gpio *chip;
+	int ret = 0;
+
+	mutex_lock(&mio->gpio_lock);
+
+	chip = mio->gpio;
+	if (!chip || offset >= chip->chip.ngpio) {
+		ret = chip ? -EINVAL : -ENODEV;
+		goto out;
+	}
+
+	mutex_lock(&chip->lock);
+	if (!(chip->dir & BIT(offset))) {
+		ret = matrixio_gpio_write(chip, MATRIXIO_GPIO_DIR,
+					  chip->dir | BIT(offset));
+		if (!ret)
+			chip->dir |= BIT(offset);
+	}
+	mutex_unlock(&chip->lock);
+
+out:
+	mutex_unlock(&mio->gpio_lock);
+
+	return ret;
+}
+EXPORT_SYMBOL(matrixio_gpio_set_output);
+
+#if IS_ENABLED(CONFIG_GPIOLIB_IRQCHIP)
+
+static void matrixio_gpio_scan(struct matrixio_gpio *gpio)
+{
+	unsigned long pending;
+	u16 value, changed;
+	unsigned int i;
+	int ret;
+
+	mutex_lock(&gpio->lock);
+
+	ret = matrixio_read(gpio->mio, MATRIXIO_GPIO_VALUE, sizeof(value),
+			    &value);
+	if (ret) {
+		mutex_unlock(&gpio->lock);
+		dev_err_ratelimited(gpio->chip.parent,
+				    "GPIO scan failed (%d)\n", ret);
+		return;
+	}
+
+	changed = value ^ gpio->last;
+	gpio->last = value;
+
+	pending = ((changed & value & gpio->irq_rising) |
+		   (changed & ~value & gpio->irq_falling) |
+		   (value & gpio->irq_high) | (~value & gpio->irq_low)) &
+		  gpio->irq_enabled;
+
+	mutex_unlock(&gpio->lock);
+
+	if (!pending)
+		return;
+
+	matrixio_notify_event(gpio->mio, MATRIXIO_EVENT_GPIO);
+
+	for_each_set_bit(i, &pending, gpio->chip.ngpio)
+		handle_nested_irq(irq_find_mapping(gpio->chip.irq.domain, i));
+}
+
+static irqreturn_t matrixio_gpio_irq_thread(int irq, void *data)
+{
+	matrixio_gpio_scan(data);
+
+	return IRQ_HANDLED;
+}
+
+static void matrixio_gpio_poll(struct work_struct *w)
+{
+	struct matrixio_gpio *gpio =
+	    container_of(to_delayed_work(w), struct matrixio_gpio, poll);
+
+	matrixio_gpio_scan(gpio);
+
+	if (READ_ONCE(gpio->irq_enabled))
+		schedule_delayed_work(&gpio->poll,
+				      msecs_to_jiffies(MATRIXIO_GPIO_POLL_MS));
+}
+
+static void matrixio_gpio_irq_mask(struct irq_data *d)
+{
+	struct gpio_chip *gc = irq_data_get_irq_chip_data(d);
+	struct matrixio_gpio *gpio = gpiochip_get_data(gc);
+	irq_hw_number_t hwirq = irqd_to_hwirq(d);
+
+	gpio->next_enabled &= ~BIT(hwirq);
+	MATRIXIO_GPIO_IRQ_DISABLE(gc, hwirq);
+}
+
+static void matrixio_gpio_irq_unmask(struct irq_data *d)
+{
+	struct gpio_chip *gc = irq_data_get_irq_chip_data(d);
+	struct matrixio_gpio *gpio = gpiochip_get_data(gc);
+	irq_hw_number_t hwirq = irqd_to_hwirq(d);
+
+	MATRIXIO_GPIO_IRQ_ENABLE(gc, hwirq);
+	gpio->next_enabled |= BIT(hwirq);
+}
+
+static int matrixio_gpio_irq_set_type(struct irq_data *d, unsigned int type)
+{
+	struct gpio_chip *gc = irq_data_get_irq_chip_data(d);
+	struct matrixio_gpio *gpio = gpiochip_get_data(gc);
+	u16 bit = BIT(irqd_to_hwirq(d));
+
+	if (!(type & IRQ_TYPE_SENSE_MASK))
+		return -EINVAL;
+
+	gpio->next_rising &= ~bit;
+	gpio->next_falling &= ~bit;
+	gpio->next_high &= ~bit;
+	gpio->next_low &= ~bit;
+
+	if (type & IRQ_TYPE_EDGE_RISING)
+		gpio->next_rising |= bit;
+	if (type & IRQ_TYPE_EDGE_FALLING)
+		gpio->next_falling |= bit;
+	if (type & IRQ_TYPE_LEVEL_HIGH)
+		gpio->next_high |= bit;
+	if (type & IRQ_TYPE_LEVEL_LOW)
+		gpio->next_low |= bit;
+
+	return 0;
+}
+
+static void matrixio_gpio_irq_bus_lock(struct irq_data *d)
+{
+	struct gpio_chip *gc = irq_data_get_irq_chip_data(d);
+	struct matrixio_gpio *gpio = gpiochip_get_data(gc);
+
+	mutex_lock(&gpio->irq_lock);
+}
+
+static void matrixio_gpio_irq_bus_sync_unlock(struct irq_data *d)
+{
+	struct gpio_chip *gc = irq_data_get_irq_chip_data(d);
+	struct matrixio_gpio *gpio = gpiochip_get_data(gc);
+	u16 enabling, value;
+	bool start;
+
+	mutex_lock(&gpio->lock);
+
+	/* Newly enabled lines start from their current level, not from
+	 * whatever they were when last scanned */
+	enabling = gpio->next_enabled & ~gpio->irq_enabled;
+	if (enabling && !matrixio_read(gpio->mio, MATRIXIO_GPIO_VALUE,
+				       sizeof(value), &value))
+		gpio->last = (gpio->last & ~enabling) | (value & enabling);
+
+	start = !gpio->irq_enabled && gpio->next_enabled;
+
+	gpio->irq_rising = gpio->next_rising;
+	gpio->irq_falling = gpio->next_falling;
+	gpio->irq_high = gpio->next_high;
+	gpio->irq_low = gpio->next_low;
+	WRITE_ONCE(gpio->irq_enabled, gpio->next_enabled);
+
+	mutex_unlock(&gpio->lock);
+
+	if (start && gpio->parent_irq <= 0)
+		schedule_delayed_work(&gpio->poll, 0);
+
+	mutex_unlock(&gpio->irq_lock);
+}
+
+static struct irq_chip matrixio_gpio_irq_chip = {
+    .name = "matrixio-gpio",
+    .irq_mask = matrixio_gpio_irq_mask,
+    .irq_unmask = matrixio_gpio_irq_unmask,
+    .irq_set_type = matrixio_gpio_irq_set_type,
+    .irq_bus_lock = matrixio_gpio_irq_bus_lock,
+    .irq_bus_sync_unlock = matrixio_gpio_irq_bus_sync_unlock,
+    .flags = MATRIXIO_GPIO_IRQ_FLAGS,
+    MATRIXIO_GPIO_IRQ_RESOURCE_HELPERS
+};
+
+static void matrixio_gpio_irq_stop(void *data)
+{
+	struct matrixio_gpio *gpio = data;
+
+	cancel_delayed_work_sync(&gpio->poll);
+}
+
+static int matrixio_gpio_irq_init(struct platform_device *pdev,
+				  struct matrixio_gpio *gpio)
+{
+	struct gpio_irq_chip *girq = &gpio->chip.irq;
+
+	mutex_init(&gpio->irq_lock);
+	INIT_DELAYED_WORK(&gpio->poll, matrixio_gpio_poll);
+
+	/* Without an interrupt line in the device tree the bank is polled */
+	gpio->parent_irq = irq_of_parse_and_map(pdev->dev.of_node, 0);
+
+	MATRIXIO_GPIO_IRQ_SET_CHIP(girq, &matrixio_gpio_irq_chip);
+	girq->handler = handle_simple_irq;
+	girq->default_type = IRQ_TYPE_NONE;
+	girq->threaded = true;
+
+	return devm_add_action_or_reset(&pdev->dev, matrixio_gpio_irq_stop,
+					gpio);
+}
+
+static int matrixio_gpio_irq_request(struct platform_device *pdev,
+				     struct matrixio_gpio *gpio)
+{
+	if (gpio->parent_irq <= 0)
+		return 0;
+
+	return devm_request_threaded_irq(&pdev->dev, gpio->parent_irq, NULL,
+					 matrixio_gpio_irq_thread, IRQF_ONESHOT,
+					 dev_name(&pdev->dev), gpio);
+}
+
+#else
+
+static int matrixio_gpio_irq_init(struct platform_device *pdev,
+				  struct matrixio_gpio *gpio)
+{
+	return 0;
+}
+
+static int matrixio_gpio_irq_request(struct platform_device *pdev,
+				     struct matrixio_gpio *gpio)
+{
+	return 0;
+}
+
+#endif
+
+static void matrixio_gpio_wave_output(struct matrixio_gpio *gpio, u16 mask,
+				      u16 value)
+{
+	u16 out;
+	int ret;
+
+	mutex_lock(&gpio->lock);
+
+	out = (gpio->out & ~mask) | (value & mask);
+	if (out != gpio->out) {
+		ret = matrixio_gpio_write(gpio, MATRIXIO_GPIO_VALUE, out);
+		if (ret)
+			dev_err_ratelimited(gpio->chip.parent,
+					    "Waveform write failed (%d)\n", ret);
+		else
+			gpio->out = out;
+	}
+
+	mutex_unlock(&gpio->lock);
+}
+
+/* Sleeps until the absolute deadline unless the queue gets cancelled */
+static void matrixio_gpio_wave_sleep(struct matrixio_gpio_wave *wave,
+				     ktime_t deadline)
+{
+	for (;;) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (atomic_read(&wave->cancel) || kthread_should_stop() ||
+		    !ktime_before(ktime_get(), deadline))
+			break;
+		schedule_hrtimeout_range(&deadline, 0, HRTIMER_MODE_ABS);
+	}
+	__set_current_state(TASK_RUNNING);
+}
+
+/* Deadlines are absolute, so time spent on the bus does not accumulate as
+ * drift; a step that is late goes out at once. */
+static int matrixio_gpio_wave_thread(void *data)
+{
+	struct matrixio_gpio_wave *wave = data;
+	struct matrixio_gpio_step step, next;
+	ktime_t deadline;
+	u16 mask, value;
+
+	MATRIXIO_SCHED_SET_FIFO(current);
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(wave->data_wait,
+					 !kfifo_is_empty(&wave->fifo) ||
+					     kthread_should_stop());
+
+		WRITE_ONCE(wave->busy, true);
+		deadline = ktime_get();
+
+		while (!kthread_should_stop() && kfifo_get(&wave->fifo, &step)) {
+			mask = step.mask;
+			value = step.value & mask;
+			while (kfifo_peek(&wave->fifo, &next) && !next.delay_us) {
+				kfifo_skip(&wave->fifo);
+				value = (value & ~next.mask) |
+					(next.value & next.mask);
+				mask |= next.mask;
+			}
+
+			deadline = ktime_add_us(deadline, step.delay_us);
+			matrixio_gpio_wave_sleep(wave, deadline);
+
+			if (atomic_read(&wave->cancel)) {
+				kfifo_reset_out(&wave->fifo);
+				break;
+			}
+
+			matrixio_gpio_wave_output(wave->gpio, mask, value);
+			wake_up_interruptible(&wave->room_wait);
+		}
+
+		WRITE_ONCE(wave->busy, false);
+		wake_up_interruptible(&wave->room_wait);
+	}
+
+	return 0;
+}
+
+static ssize_t matrixio_gpio_wave_write(struct file *filp,
+					const char __user *buf, size_t count,
+					loff_t *f_pos)
+{
+	struct matrixio_gpio_wave *wave = filp->private_data;
+	unsigned int copied;
+	size_t done = 0;
+	int ret = 0;
+
+	count -= count % sizeof(struct matrixio_gpio_step);
+	if (!count)
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&wave->write_lock))
+		return -ERESTARTSYS;
+
+	while (done < count) {
+		if (kfifo_is_full(&wave->fifo)) {
+			if (filp->f_flags & O_NONBLOCK) {
+				ret = -EAGAIN;
+				break;
+			}
+			ret = wait_event_interruptible(
+			    wave->room_wait, !kfifo_is_full(&wave->fifo));
+			if (ret)
+				break;
+		}
+
+		ret = kfifo_from_user(&wave->fifo, buf + done, count - done,
+				      &copied);
+		if (ret)
+			break;
+
+		done += copied;
+		wake_up_interruptible(&wave->data_wait);
+	}
+
+	mutex_unlock(&wave->write_lock);
+
+	return done ? done : ret;
+}
+
+static __poll_t matrixio_gpio_wave_poll(struct file *filp,
+					struct poll_table_struct *wait)
+{
+	struct matrixio_gpio_wave *wave = filp->private_data;
+
+	poll_wait(filp, &wave->room_wait, wait);
+
+	if (!kfifo_is_full(&wave->fifo))
+		return EPOLLOUT | EPOLLWRNORM;
+
+	return 0;
+}
+
+static bool matrixio_gpio_wave_idle(struct matrixio_gpio_wave *wave)
+{
+	return kfifo_is_empty(&wave->fifo) && !READ_ONCE(wave->busy);
+}
+
+static int matrixio_gpio_wave_fsync(struct file *filp, loff_t start,
+				    loff_t end, int datasync)
+{
+	struct matrixio_gpio_wave *wave = filp->private_data;
+
+	return wait_event_interruptible(wave->room_wait,
+					matrixio_gpio_wave_idle(wave));
+}
+
+static long matrixio_gpio_wave_ioctl(struct file *filp, unsigned int cmd,
+				     unsigned long arg)
+{
+	struct matrixio_gpio_wave *wave = filp->private_data;
+
+	switch (cmd) {
+	case MATRIXIO_GPIO_WAVE_IOC_CANCEL:
+		/* Holding the write lock keeps new steps out until the thread
+		 * has dropped the old ones */
+		mutex_lock(&wave->write_lock);
+		atomic_set(&wave->cancel, 1);
+		wake_up_process(wave->thread);
+		wait_event(wave->room_wait, matrixio_gpio_wave_idle(wave));
+		atomic_set(&wave->cancel, 0);
+		mutex_unlock(&wave->write_lock);
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+static int matrixio_gpio_wave_open(struct inode *inode, struct file *filp)
+{
+	filp->private_data =
+	    container_of(inode->i_cdev, struct matrixio_gpio_wave, cdev);
+
+	return nonseekable_open(inode, filp);
+}
+
+static const struct file_operations matrixio_gpio_wave_file_operations = {
+    .owner = THIS_MODULE,
+    .open = matrixio_gpio_wave_open,
+    .write = matrixio_gpio_wave_write,
+    .poll = matrixio_gpio_wave_poll,
+    .fsync = matrixio_gpio_wave_fsync,
+    .unlocked_ioctl = matrixio_gpio_wave_ioctl,
+};
+
+static int matrixio_gpio_wave_uevent(struct device *dev,
+				     struct kobj_uevent_env *env)
+{
+	(void)dev; /* unused parameter */
+	add_uevent_var(env, "DEVMODE=%#o", 0666);
+	return 0;
+}
+
+static int matrixio_gpio_wave_probe(struct platform_device *pdev,
+				    struct matrixio_gpio *gpio)
+{
+	struct matrixio_gpio_wave *wave;
+	int ret;
+
+	wave = devm_kzalloc(&pdev->dev, sizeof(*wave), GFP_KERNEL);
+	if (!wave)
+		return -ENOMEM;
+
+	wave->gpio = gpio;
+	INIT_KFIFO(wave->fifo);
+	mutex_init(&wave->write_lock);
+	init_waitqueue_head(&wave->data_wait);
+	init_waitqueue_head(&wave->room_wait);
+	atomic_set(&wave->cancel, 0);
+
+	wave->thread = kthread_run(matrixio_gpio_wave_thread, wave,
+				   "matrixio_gpio_wave");
+	if (IS_ERR(wave->thread))
+		return PTR_ERR(wave->thread);
+
+	ret = alloc_chrdev_region(&wave->devt, 0, 1, "matrixio_gpio_wave");
+	if (ret)
+		goto err_thread;
+
+	wave->cl = MATRIXIO_CLASS_CREATE("matrixio_gpio_wave");
+	if (IS_ERR(wave->cl)) {
+		ret = PTR_ERR(wave->cl);
+		goto err_region;
+	}
+	wave->cl->dev_uevent = MATRIXIO_UEVENT_CAST(matrixio_gpio_wave_uevent);
+
+	cdev_init(&wave->cdev, &matrixio_gpio_wave_file_operations);
+	ret = cdev_add(&wave->cdev, wave->devt, 1);
+	if (ret)
+		goto err_class;
+
+	wave->device = device_create(wave->cl, NULL, wave->devt, NULL,
+				     "matrixio_gpio_wave");
+	if (IS_ERR(wave->device)) {
+		ret = PTR_ERR(wave->device);
+		goto err_cdev;
+	}
+
+	gpio->wave = wave;
+
+	return 0;
+
+err_cdev:
+	cdev_del(&wave->cdev);
+err_class:
+	class_destroy(wave->cl);
+err_region:
+	unregister_chrdev_region(wave->devt, 1);
+err_thread:
+	kthread_stop(wave->thread);
+	return ret;
+}
+
+static void matrixio_gpio_wave_remove(struct matrixio_gpio *gpio)
+{
+	struct matrixio_gpio_wave *wave = gpio->wave;
+
+	device_destroy(wave->cl, wave->devt);
+	cdev_del(&wave->cdev);
+	class_destroy(wave->cl);
+	unregister_chrdev_region(wave->devt, 1);
+	kthread_stop(wave->thread);
+}
+
 static const struct gpio_chip matrixio_gpio_chip = {
     .label = "matrixio-gpio",
     .owner = THIS_MODULE,
@@ -109,6 +722,8 @@ static const struct gpio_chip matrixio_gpio_chip = {
     .direction_output = matrixio_gpio_direction_output,
     .get = matrixio_gpio_get,
     .set = matrixio_gpio_set,
+    .get_multiple = matrixio_gpio_get_multiple,
+    .set_multiple = matrixio_gpio_set_multiple,
     .base = -1,
     .ngpio = 16,
     .can_sleep = true,
@@ -117,6 +732,7 @@ static const struct gpio_chip matrixio_gpio_chip = {
 static int matrixio_gpio_probe(struct platform_device *pdev)
 {
 	struct matrixio_gpio *gpio;
+	u16 regs[2];
 	int ret;
 
 	gpio = devm_kzalloc(&pdev->dev, sizeof(*gpio), GFP_KERNEL);
@@ -131,14 +747,46 @@ static int matrixio_gpio_probe(struct platform_device *pdev)
 
 	mutex_init(&gpio->lock);
 
-    ret = devm_gpiochip_add_data(&pdev->dev, &gpio->chip, gpio);
+	/* Direction and value registers are adjacent, fetch both at once */
+	ret = matrixio_read(gpio->mio, MATRIXIO_GPIO_DIR, sizeof(regs), regs);
+	if (ret) {
+		dev_err(&pdev->dev, "Could not read GPIO state, %d\n", ret);
+		return ret;
+	}
+	gpio->dir = regs[0];
+	gpio->out = regs[1];
+	gpio->last = regs[1];
+
+	ret = matrixio_gpio_irq_init(pdev, gpio);
+	if (ret)
+		return ret;
+
+	ret = devm_gpiochip_add_data(&pdev->dev, &gpio->chip, gpio);
 
 	if (ret) {
 		dev_err(&pdev->dev, "Could not register gpiochip, %d\n", ret);
 		return ret;
 	}
 
-	MATRIXIO_REMOVE_RETURN();
+	ret = matrixio_gpio_irq_request(pdev, gpio);
+	if (ret) {
+		dev_err(&pdev->dev, "Could not request GPIO interrupt, %d\n",
+			ret);
+		return ret;
+	}
+
+	ret = matrixio_gpio_wave_probe(pdev, gpio);
+	if (ret) {
+		dev_err(&pdev->dev, "Could not create waveform device, %d\n",
+			ret);
+		return ret;
+	}
+
+	mutex_lock(&gpio->mio->gpio_lock);
+	gpio->mio->gpio = gpio;
+	mutex_unlock(&gpio->mio->gpio_lock);
+
+	return 0;
 }
 
 static MATRIXIO_REMOVE_RETURN_TYPE matrixio_gpio_remove(struct platform_device *pdev)
@@ -146,6 +794,10 @@ static MATRIXIO_REMOVE_RETURN_TYPE matrixio_gpio_remove(struct platform_device *
 
 	struct matrixio_gpio *gpio;
 	gpio = dev_get_drvdata(&pdev->dev);
+	mutex_lock(&gpio->mio->gpio_lock);
+	gpio->mio->gpio = NULL;
+	mutex_unlock(&gpio->mio->gpio_lock);
+	matrixio_gpio_wave_remove(gpio);
 	mutex_destroy(&gpio->lock);
 	MATRIXIO_REMOVE_RETURN();
 }
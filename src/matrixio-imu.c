@@ -14,90 +14,155 @@
 
 #include <linux/delay.h>
 #include <linux/err.h>
+#include <linux/iio/buffer.h>
 #include <linux/iio/iio.h>
+#include <linux/iio/sysfs.h>
+#include <linux/iio/trigger.h>
+#include <linux/iio/trigger_consumer.h>
+#include <linux/iio/triggered_buffer.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
 #include <linux/platform_device.h>
 
 #include "matrixio-core.h"
+#include "matrixio-imu.h"
 
 #define MATRIXIO_UV_DRV_NAME "matrixio_imu"
 
 #define MATRIXIO_SRAM_OFFSET_IMU 0x30
 #define MATRIXIO_CALIB_OFFSET 6
 
+#define MATRIXIO_IMU_AXES 9
+#define MATRIXIO_IMU_MAGN_FIRST 6
+#define MATRIXIO_IMU_OVERSAMPLING_MAX 16
+/* The quaternion is scanned first: the IIO core aligns it to its 16 byte
+ * size, which after the axes would leave the timestamp short of the end of
+ * the scan, where iio_push_to_buffers_with_timestamp() writes it. */
+#define MATRIXIO_IMU_QUAT 0
+#define MATRIXIO_IMU_SCAN_AXES 1 /* scan index of the first axis */
+#define MATRIXIO_IMU_AXIS(chan) ((chan)->scan_index - MATRIXIO_IMU_SCAN_AXES)
+
+/* A calibration run needs this many samples and a radius, half the swing
+ * between extremes, of at least 0.05 gauss on every magnetometer axis */
+#define MATRIXIO_IMU_CALIB_MIN_SAMPLES 100
+#define MATRIXIO_IMU_CALIB_MIN_RADIUS 50000
+#define MATRIXIO_IMU_MATRIX_ONE 1000000
+
+/* The orientation filter works in Q24 fixed point */
+#define MATRIXIO_AHRS_SHIFT 24
+#define MATRIXIO_AHRS_ONE (1 << MATRIXIO_AHRS_SHIFT)
+#define MATRIXIO_AHRS_BETA (MATRIXIO_AHRS_ONE / 10) /* Gradient step gain */
+
 struct matrixio_bus {
 	struct matrixio *mio;
-	struct mutex lock;
+	struct mutex lock; /* Guards everything below */
+	/* Averaged sample in micro-units of m/s^2, rad/s and gauss, handed
+	 * out again until it is 1 / samp_freq old so that readers faster
+	 * than the data changes cause no bus traffic */
+	s32 values[MATRIXIO_IMU_AXES];
+	s32 magn_offset[3]; /* Added to the magnetometer in the processed path */
+	/* Soft-iron correction applied after magn_offset, scaled by 1000000 */
+	s32 magn_matrix[3][3];
+	/* Magnetometer extremes seen by every fetch while calibrating */
+	bool calibrating;
+	s32 magn_min[3];
+	s32 magn_max[3];
+	unsigned int calib_samples;
+	ktime_t expires;
+	bool valid;
+	/* Set when a fetch reads the MCU, cleared once that sample is
+	 * buffered, so a trigger faster than samp_freq pushes no repeats */
+	bool fresh;
+	int samp_freq;
+	/* The last oversampling reads of the MCU block and their sum */
+	int oversampling;
+	s32 history[MATRIXIO_IMU_OVERSAMPLING_MAX][MATRIXIO_IMU_AXES];
+	s64 sum[MATRIXIO_IMU_AXES];
+	unsigned int hist_pos;
+	unsigned int hist_len;
+	/* Madgwick orientation as w, x, y, z in Q24, updated per scan */
+	s32 quat[4];
+	u64 quat_ns;
+	/* One scan as pushed to the buffer, for each of the scan masks */
+	union {
+		struct {
+			__le32 values[MATRIXIO_IMU_AXES];
+			s64 timestamp __aligned(8);
+		} axes;
+		struct {
+			__le32 quat[4];
+			__le32 values[MATRIXIO_IMU_AXES];
+			s64 timestamp __aligned(8);
+		} orient;
+	} scan;
 };
 
+static_assert(sizeof_field(struct matrixio_bus, scan.axes) == 48);
+static_assert(sizeof_field(struct matrixio_bus, scan.orient) == 64);
+
+static const int matrixio_imu_samp_freq_avail[] = {10, 25, 50, 100, 200};
+static const int matrixio_imu_oversampling_avail[] = {1, 2, 4, 8, 16};
+
+#define MATRIXIO_IMU_CHANNEL(_type, _mod, _index, _mask)                       \
+	{                                                                      \
+		.type = (_type), .modified = 1, .channel2 = (_mod),            \
+		.address = (_index) * 2,                                       \
+		.scan_index = MATRIXIO_IMU_SCAN_AXES + (_index),               \
+		.info_mask_separate = (_mask),                                 \
+		.info_mask_shared_by_type = BIT(IIO_CHAN_INFO_SCALE),          \
+		.info_mask_shared_by_all = MATRIXIO_IMU_SHARED,                \
+		.info_mask_shared_by_all_available = MATRIXIO_IMU_SHARED,      \
+		.scan_type = {                                                 \
+		    .sign = 's',                                               \
+		    .realbits = 32,                                            \
+		    .storagebits = 32,                                         \
+		    .endianness = IIO_LE,                                      \
+		},                                                             \
+	}
+
+#define MATRIXIO_IMU_SHARED                                                    \
+	(BIT(IIO_CHAN_INFO_SAMP_FREQ) | BIT(IIO_CHAN_INFO_OVERSAMPLING_RATIO))
+#define MATRIXIO_IMU_RAW (BIT(IIO_CHAN_INFO_RAW) | BIT(IIO_CHAN_INFO_PROCESSED))
+#define MATRIXIO_IMU_CALIB                                                     \
+	(MATRIXIO_IMU_RAW | BIT(IIO_CHAN_INFO_CALIBBIAS) |                     \
+	 BIT(IIO_CHAN_INFO_OFFSET))
+
 static const struct iio_chan_spec matrixio_imu_channels[] = {
     {
-	.type = IIO_ACCEL,
-	.modified = 1,
-	.channel2 = IIO_MOD_X,
-	.address = 0,
-	.info_mask_separate = BIT(IIO_CHAN_INFO_RAW),
-    },
-    {
-	.type = IIO_ACCEL,
-	.modified = 1,
-	.channel2 = IIO_MOD_Y,
-	.address = 2,
-	.info_mask_separate = BIT(IIO_CHAN_INFO_RAW),
-    },
-    {
-	.type = IIO_ACCEL,
-	.modified = 1,
-	.channel2 = IIO_MOD_Z,
-	.address = 4,
-	.info_mask_separate = BIT(IIO_CHAN_INFO_RAW),
-    },
-    {
-	.type = IIO_ANGL_VEL,
-	.modified = 1,
-	.channel2 = IIO_MOD_X,
-	.address = 6,
-	.info_mask_separate = BIT(IIO_CHAN_INFO_RAW),
-    },
-    {
-	.type = IIO_ANGL_VEL,
-	.modified = 1,
-	.channel2 = IIO_MOD_Y,
-	.address = 8,
-	.info_mask_separate = BIT(IIO_CHAN_INFO_RAW),
-    },
-    {
-	.type = IIO_ANGL_VEL,
-	.modified = 1,
-	.channel2 = IIO_MOD_Z,
-	.address = 10,
-	.info_mask_separate = BIT(IIO_CHAN_INFO_RAW),
-    },
-    {
-	.type = IIO_MAGN,
-	.modified = 1,
-	.channel2 = IIO_MOD_X,
-	.address = 12,
-	.info_mask_separate =
-	    BIT(IIO_CHAN_INFO_RAW) | BIT(IIO_CHAN_INFO_CALIBBIAS),
-    },
-    {
-	.type = IIO_MAGN,
+	.type = IIO_ROT,
 	.modified = 1,
-	.channel2 = IIO_MOD_Y,
-	.address = 14,
-	.info_mask_separate =
-	    BIT(IIO_CHAN_INFO_RAW) | BIT(IIO_CHAN_INFO_CALIBBIAS),
+	.channel2 = IIO_MOD_QUATERNION,
+	.info_mask_shared_by_type = BIT(IIO_CHAN_INFO_SCALE),
+	.scan_index = MATRIXIO_IMU_QUAT,
+	.scan_type =
+	    {
+		.sign = 's',
+		.realbits = 32,
+		.storagebits = 32,
+		.repeat = 4,
+		.endianness = IIO_LE,
+	    },
     },
-    {
-	.type = IIO_MAGN,
-	.modified = 1,
-	.channel2 = IIO_MOD_Z,
-	.address = 16,
-	.info_mask_separate =
-	    BIT(IIO_CHAN_INFO_RAW) | BIT(IIO_CHAN_INFO_CALIBBIAS),
-    }};
+    MATRIXIO_IMU_CHANNEL(IIO_ACCEL, IIO_MOD_X, 0, MATRIXIO_IMU_RAW),
+    MATRIXIO_IMU_CHANNEL(IIO_ACCEL, IIO_MOD_Y, 1, MATRIXIO_IMU_RAW),
+    MATRIXIO_IMU_CHANNEL(IIO_ACCEL, IIO_MOD_Z, 2, MATRIXIO_IMU_RAW),
+    MATRIXIO_IMU_CHANNEL(IIO_ANGL_VEL, IIO_MOD_X, 3, MATRIXIO_IMU_RAW),
+    MATRIXIO_IMU_CHANNEL(IIO_ANGL_VEL, IIO_MOD_Y, 4, MATRIXIO_IMU_RAW),
+    MATRIXIO_IMU_CHANNEL(IIO_ANGL_VEL, IIO_MOD_Z, 5, MATRIXIO_IMU_RAW),
+    MATRIXIO_IMU_CHANNEL(IIO_MAGN, IIO_MOD_X, 6, MATRIXIO_IMU_CALIB),
+    MATRIXIO_IMU_CHANNEL(IIO_MAGN, IIO_MOD_Y, 7, MATRIXIO_IMU_CALIB),
+    MATRIXIO_IMU_CHANNEL(IIO_MAGN, IIO_MOD_Z, 8, MATRIXIO_IMU_CALIB),
+    IIO_CHAN_SOFT_TIMESTAMP(MATRIXIO_IMU_SCAN_AXES + MATRIXIO_IMU_AXES),
+};
+
+/* The MCU block is always read whole, the IIO core picks the channels.
+ * The orientation is only computed when the quaternion is captured. */
+static const unsigned long matrixio_imu_scan_masks[] = {
+    GENMASK(MATRIXIO_IMU_AXES, MATRIXIO_IMU_SCAN_AXES),
+    GENMASK(MATRIXIO_IMU_AXES, MATRIXIO_IMU_QUAT), 0};
 
 static void matrixio_int_to_int_plus_micro(int data, int *val, int *val2)
 {
@@ -110,6 +175,325 @@ static int matrixio_int_plus_micro_to_int(int val, int val2)
 	return val * 1000 + (val2 / 1000);
 }
 
+/* The MCU reports milli-g, millidegrees per second and milligauss. They are
+ * converted once per read of the block, so raw values and the buffer carry
+ * micro-units of m/s^2, rad/s and gauss and share a scale of 0.000001. */
+static s32 matrixio_imu_to_micro(unsigned int axis, s64 milli)
+{
+	s64 micro;
+
+	switch (axis / 3) {
+	case 0:
+		micro = div_s64(milli * 980665, 100);
+		break;
+	case 1:
+		micro = div_s64(milli * 174533, 10000);
+		break;
+	default:
+		micro = milli * 1000;
+		break;
+	}
+
+	return clamp_t(s64, micro, S32_MIN, S32_MAX);
+}
+
+/* Called with data->lock held. Hard-iron offset, then soft-iron matrix. */
+static void matrixio_imu_magn_processed(struct matrixio_bus *data, s32 *out)
+{
+	s64 v[3], sum;
+	int i, j;
+
+	for (i = 0; i < 3; i++)
+		v[i] = (s64)data->values[MATRIXIO_IMU_MAGN_FIRST + i] +
+		       data->magn_offset[i];
+
+	for (i = 0; i < 3; i++) {
+		sum = 0;
+		for (j = 0; j < 3; j++)
+			sum += data->magn_matrix[i][j] * v[j];
+		out[i] = clamp_t(s64, div_s64(sum, MATRIXIO_IMU_MATRIX_ONE),
+				 S32_MIN, S32_MAX);
+	}
+}
+
+static void matrixio_imu_calib_sample(struct matrixio_bus *data)
+{
+	s32 v;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		v = data->values[MATRIXIO_IMU_MAGN_FIRST + i];
+		data->magn_min[i] = min(data->magn_min[i], v);
+		data->magn_max[i] = max(data->magn_max[i], v);
+	}
+	data->calib_samples++;
+}
+
+/* The centre of the extremes is the hard-iron bias. Scaling each axis to
+ * the mean radius undoes the soft-iron stretch along the sensor axes; a
+ * min/max run cannot see rotated ellipsoids, so the matrix is diagonal. */
+static int matrixio_imu_calib_finish(struct matrixio_bus *data)
+{
+	s64 radius[3], mean = 0;
+	int i;
+
+	if (data->calib_samples < MATRIXIO_IMU_CALIB_MIN_SAMPLES)
+		return -ENODATA;
+
+	for (i = 0; i < 3; i++) {
+		radius[i] = ((s64)data->magn_max[i] - data->magn_min[i]) / 2;
+		if (radius[i] < MATRIXIO_IMU_CALIB_MIN_RADIUS)
+			return -ENODATA;
+		mean += radius[i];
+	}
+	mean = div_s64(mean, 3);
+
+	memset(data->magn_matrix, 0, sizeof(data->magn_matrix));
+	for (i = 0; i < 3; i++) {
+		data->magn_offset[i] =
+		    -(s32)(((s64)data->magn_max[i] + data->magn_min[i]) / 2);
+		data->magn_matrix[i][i] =
+		    div64_s64(mean * MATRIXIO_IMU_MATRIX_ONE, radius[i]);
+	}
+
+	return 0;
+}
+
+static void matrixio_imu_reset(struct matrixio_bus *data)
+{
+	memset(data->sum, 0, sizeof(data->sum));
+	data->hist_pos = 0;
+	data->hist_len = 0;
+	data->valid = false;
+}
+
+static bool matrixio_imu_in_list(const int *list, int len, int val)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		if (list[i] == val)
+			return true;
+
+	return false;
+}
+
+/* Called with data->lock held. Reads the MCU block at most once per sample
+ * period and averages over the last oversampling reads. */
+static int matrixio_imu_fetch(struct matrixio_bus *data)
+{
+	s32 raw[MATRIXIO_IMU_AXES];
+	ktime_t now = ktime_get();
+	s32 *old;
+	int i, ret;
+
+	if (data->valid && ktime_before(now, data->expires))
+		return 0;
+
+	ret = matrixio_read(data->mio,
+			    MATRIXIO_MCU_BASE + (MATRIXIO_SRAM_OFFSET_IMU >> 1),
+			    sizeof(raw), raw);
+	if (ret)
+		return ret;
+
+	old = data->history[data->hist_pos];
+	if (data->hist_len == data->oversampling)
+		for (i = 0; i < MATRIXIO_IMU_AXES; i++)
+			data->sum[i] -= old[i];
+	else
+		data->hist_len++;
+
+	for (i = 0; i < MATRIXIO_IMU_AXES; i++) {
+		old[i] = raw[i];
+		data->sum[i] += raw[i];
+		data->values[i] = matrixio_imu_to_micro(
+		    i, div_s64(data->sum[i], data->hist_len));
+	}
+
+	if (data->calibrating)
+		matrixio_imu_calib_sample(data);
+
+	data->hist_pos = (data->hist_pos + 1) % data->oversampling;
+	data->expires = ktime_add_ns(now, NSEC_PER_SEC / data->samp_freq);
+	data->valid = true;
+	data->fresh = true;
+
+	return 0;
+}
+
+static inline s32 matrixio_ahrs_mul(s32 a, s32 b)
+{
+	return (s32)(((s64)a * b) >> MATRIXIO_AHRS_SHIFT);
+}
+
+/* Scales a vector of any unit to length one in Q24 */
+static bool matrixio_ahrs_normalize(const s32 *in, s32 *out, int len)
+{
+	u64 sq = 0;
+	s64 norm;
+	int i;
+
+	for (i = 0; i < len; i++)
+		sq += (s64)in[i] * in[i];
+
+	norm = int_sqrt64(sq);
+	if (!norm)
+		return false;
+
+	for (i = 0; i < len; i++)
+		out[i] = div64_s64((s64)in[i] << MATRIXIO_AHRS_SHIFT, norm);
+
+	return true;
+}
+
+#define M(a, b) matrixio_ahrs_mul(a, b)
+
+/* Gradient of the gravity and magnetic field error, Madgwick's MARG
+ * formulation. q, a and m are unit vectors in Q24. */
+static void matrixio_ahrs_marg_step(const s32 *q, const s32 *a, const s32 *m,
+				    s32 *s)
+{
+	s32 q0 = q[0], q1 = q[1], q2 = q[2], q3 = q[3];
+	s32 mx = m[0], my = m[1], mz = m[2];
+	s32 _2q0mx, _2q0my, _2q0mz, _2q1mx, _2q0, _2q1, _2q2, _2q3;
+	s32 q0q0, q0q1, q0q2, q0q3, q1q1, q1q2, q1q3, q2q2, q2q3, q3q3;
+	s32 hx, hy, _2bx, _2bz, _4bx, _4bz;
+	s32 ex, ey, ez, fx, fy, fz;
+
+	_2q0mx = 2 * M(q0, mx);
+	_2q0my = 2 * M(q0, my);
+	_2q0mz = 2 * M(q0, mz);
+	_2q1mx = 2 * M(q1, mx);
+	_2q0 = 2 * q0;
+	_2q1 = 2 * q1;
+	_2q2 = 2 * q2;
+	_2q3 = 2 * q3;
+	q0q0 = M(q0, q0);
+	q0q1 = M(q0, q1);
+	q0q2 = M(q0, q2);
+	q0q3 = M(q0, q3);
+	q1q1 = M(q1, q1);
+	q1q2 = M(q1, q2);
+	q1q3 = M(q1, q3);
+	q2q2 = M(q2, q2);
+	q2q3 = M(q2, q3);
+	q3q3 = M(q3, q3);
+
+	/* Reference direction of the earth's field */
+	hx = M(mx, q0q0) - M(_2q0my, q3) + M(_2q0mz, q2) + M(mx, q1q1) +
+	     M(M(_2q1, my), q2) + M(M(_2q1, mz), q3) - M(mx, q2q2) -
+	     M(mx, q3q3);
+	hy = M(_2q0mx, q3) + M(my, q0q0) - M(_2q0mz, q1) + M(_2q1mx, q2) -
+	     M(my, q1q1) + M(my, q2q2) + M(M(_2q2, mz), q3) - M(my, q3q3);
+	_2bx = int_sqrt64((s64)hx * hx + (s64)hy * hy);
+	_2bz = -M(_2q0mx, q2) + M(_2q0my, q1) + M(mz, q0q0) + M(_2q1mx, q3) -
+	       M(mz, q1q1) + M(M(_2q2, my), q3) - M(mz, q2q2) + M(mz, q3q3);
+	_4bx = 2 * _2bx;
+	_4bz = 2 * _2bz;
+
+	/* Predicted minus measured gravity and field directions */
+	ex = 2 * q1q3 - 2 * q0q2 - a[0];
+	ey = 2 * q0q1 + 2 * q2q3 - a[1];
+	ez = MATRIXIO_AHRS_ONE - 2 * q1q1 - 2 * q2q2 - a[2];
+	fx = M(_2bx, MATRIXIO_AHRS_ONE / 2 - q2q2 - q3q3) +
+	     M(_2bz, q1q3 - q0q2) - mx;
+	fy = M(_2bx, q1q2 - q0q3) + M(_2bz, q0q1 + q2q3) - my;
+	fz = M(_2bx, q0q2 + q1q3) +
+	     M(_2bz, MATRIXIO_AHRS_ONE / 2 - q1q1 - q2q2) - mz;
+
+	s[0] = -M(_2q2, ex) + M(_2q1, ey) - M(M(_2bz, q2), fx) +
+	       M(M(_2bz, q1) - M(_2bx, q3), fy) + M(M(_2bx, q2), fz);
+	s[1] = M(_2q3, ex) + M(_2q0, ey) - M(4 * q1, ez) +
+	       M(M(_2bz, q3), fx) + M(M(_2bx, q2) + M(_2bz, q0), fy) +
+	       M(M(_2bx, q3) - M(_4bz, q1), fz);
+	s[2] = -M(_2q0, ex) + M(_2q3, ey) - M(4 * q2, ez) +
+	       M(-M(_4bx, q2) - M(_2bz, q0), fx) +
+	       M(M(_2bx, q1) + M(_2bz, q3), fy) +
+	       M(M(_2bx, q0) - M(_4bz, q2), fz);
+	s[3] = M(_2q1, ex) + M(_2q2, ey) + M(M(_2bz, q1) - M(_4bx, q3), fx) +
+	       M(M(_2bz, q2) - M(_2bx, q0), fy) + M(M(_2bx, q1), fz);
+}
+
+/* Same without a usable magnetometer, heading then drifts with the gyro */
+static void matrixio_ahrs_imu_step(const s32 *q, const s32 *a, s32 *s)
+{
+	s32 q0 = q[0], q1 = q[1], q2 = q[2], q3 = q[3];
+	s32 q0q0 = M(q0, q0), q1q1 = M(q1, q1), q2q2 = M(q2, q2),
+	    q3q3 = M(q3, q3);
+
+	s[0] = M(4 * q0, q2q2) + M(2 * q2, a[0]) + M(4 * q0, q1q1) -
+	       M(2 * q1, a[1]);
+	s[1] = M(4 * q1, q3q3) - M(2 * q3, a[0]) + M(4 * q0q0, q1) -
+	       M(2 * q0, a[1]) - 4 * q1 + M(8 * q1, q1q1) + M(8 * q1, q2q2) +
+	       M(4 * q1, a[2]);
+	s[2] = M(4 * q0q0, q2) + M(2 * q0, a[0]) + M(4 * q2, q3q3) -
+	       M(2 * q3, a[1]) - 4 * q2 + M(8 * q2, q1q1) + M(8 * q2, q2q2) +
+	       M(4 * q2, a[2]);
+	s[3] = M(4 * q1q1, q3) - M(2 * q1, a[0]) + M(4 * q2q2, q3) -
+	       M(2 * q2, a[1]);
+}
+
+/* One filter step on the Q24 orientation q. g is the gyro rate in Q24
+ * rad/s and dt the step in Q24 seconds. acc and magn may be in any unit,
+ * a zero vector skips its correction. */
+VISIBLE_IF_KUNIT void matrixio_ahrs_step(s32 *q, const s32 *g, const s32 *acc,
+					 const s32 *magn, s32 dt)
+{
+	s32 a[3], m[3], s[4], qdot[4];
+	int i;
+
+	qdot[0] = (-M(q[1], g[0]) - M(q[2], g[1]) - M(q[3], g[2])) / 2;
+	qdot[1] = (M(q[0], g[0]) + M(q[2], g[2]) - M(q[3], g[1])) / 2;
+	qdot[2] = (M(q[0], g[1]) - M(q[1], g[2]) + M(q[3], g[0])) / 2;
+	qdot[3] = (M(q[0], g[2]) + M(q[1], g[1]) - M(q[2], g[0])) / 2;
+
+	if (matrixio_ahrs_normalize(acc, a, 3)) {
+		if (matrixio_ahrs_normalize(magn, m, 3))
+			matrixio_ahrs_marg_step(q, a, m, s);
+		else
+			matrixio_ahrs_imu_step(q, a, s);
+
+		if (matrixio_ahrs_normalize(s, s, 4))
+			for (i = 0; i < 4; i++)
+				qdot[i] -= M(MATRIXIO_AHRS_BETA, s[i]);
+	}
+
+	for (i = 0; i < 4; i++)
+		q[i] += M(qdot[i], dt);
+
+	if (!matrixio_ahrs_normalize(q, q, 4)) {
+		q[0] = MATRIXIO_AHRS_ONE;
+		q[1] = q[2] = q[3] = 0;
+	}
+}
+EXPORT_SYMBOL_IF_KUNIT(matrixio_ahrs_step);
+
+#undef M
+
+/* Called with data->lock held and a fresh sample in data->values. The
+ * gyro rate is integrated over the time since the previous scan and
+ * corrected towards gravity and magnetic north. */
+static void matrixio_ahrs_update(struct matrixio_bus *data)
+{
+	s32 g[3], m[3], dt;
+	u64 now = ktime_get_ns();
+	u64 elapsed = now - data->quat_ns;
+	int i;
+
+	data->quat_ns = now;
+	/* Restart integration after the buffer was off for a while */
+	if (elapsed >= NSEC_PER_SEC)
+		return;
+	dt = div_u64(elapsed << MATRIXIO_AHRS_SHIFT, NSEC_PER_SEC);
+
+	for (i = 0; i < 3; i++)
+		g[i] = div_s64((s64)data->values[3 + i] << MATRIXIO_AHRS_SHIFT,
+			       1000000);
+	matrixio_imu_magn_processed(data, m);
+
+	matrixio_ahrs_step(data->quat, g, data->values, m, dt);
+}
+
 static int matrixio_imu_write_raw(struct iio_dev *indio_dev,
 				  struct iio_chan_spec const *chan, int val,
 				  int val2, long mask)
@@ -133,7 +517,39 @@ static int matrixio_imu_write_raw(struct iio_dev *indio_dev,
 		return ret;
 	}
 
-	return -EINVAL;
+	switch (mask) {
+	case IIO_CHAN_INFO_OFFSET:
+		if (val2 || chan->type != IIO_MAGN)
+			return -EINVAL;
+		mutex_lock(&data->lock);
+		data->magn_offset[MATRIXIO_IMU_AXIS(chan) -
+				  MATRIXIO_IMU_MAGN_FIRST] = val;
+		mutex_unlock(&data->lock);
+		return 0;
+	case IIO_CHAN_INFO_SAMP_FREQ:
+		if (val2 || !matrixio_imu_in_list(
+				matrixio_imu_samp_freq_avail,
+				ARRAY_SIZE(matrixio_imu_samp_freq_avail), val))
+			return -EINVAL;
+		mutex_lock(&data->lock);
+		data->samp_freq = val;
+		data->valid = false;
+		mutex_unlock(&data->lock);
+		return 0;
+	case IIO_CHAN_INFO_OVERSAMPLING_RATIO:
+		if (val2 || !matrixio_imu_in_list(
+				matrixio_imu_oversampling_avail,
+				ARRAY_SIZE(matrixio_imu_oversampling_avail),
+				val))
+			return -EINVAL;
+		mutex_lock(&data->lock);
+		data->oversampling = val;
+		matrixio_imu_reset(data);
+		mutex_unlock(&data->lock);
+		return 0;
+	default:
+		return -EINVAL;
+	}
 }
 
 static int matrixio_imu_read_raw(struct iio_dev *indio_dev,
@@ -150,8 +566,53 @@ static int matrixio_imu_read_raw(struct iio_dev *indio_dev,
 		offset = chan->address + MATRIXIO_CALIB_OFFSET;
 		break;
 	case IIO_CHAN_INFO_RAW:
-		offset = chan->address;
-		break;
+	case IIO_CHAN_INFO_PROCESSED:
+		ret = MATRIXIO_IIO_LOCK(indio_dev);
+		if (ret < 0)
+			return ret;
+		mutex_lock(&data->lock);
+		ret = matrixio_imu_fetch(data);
+		data_read = data->values[MATRIXIO_IMU_AXIS(chan)];
+		if (mask == IIO_CHAN_INFO_PROCESSED && chan->type == IIO_MAGN) {
+			s32 magn[3];
+
+			matrixio_imu_magn_processed(data, magn);
+			data_read = magn[MATRIXIO_IMU_AXIS(chan) -
+					 MATRIXIO_IMU_MAGN_FIRST];
+		}
+		mutex_unlock(&data->lock);
+		MATRIXIO_IIO_UNLOCK(indio_dev);
+		if (ret)
+			return ret;
+		if (mask == IIO_CHAN_INFO_RAW) {
+			*val = data_read;
+			return IIO_VAL_INT;
+		}
+		*val = data_read / 1000000;
+		*val2 = data_read % 1000000;
+		return IIO_VAL_INT_PLUS_MICRO;
+	case IIO_CHAN_INFO_SCALE:
+		/* The buffered quaternion is in Q30 */
+		if (chan->type == IIO_ROT) {
+			*val = 1;
+			*val2 = 30;
+			return IIO_VAL_FRACTIONAL_LOG2;
+		}
+		*val = 0;
+		*val2 = 1;
+		return IIO_VAL_INT_PLUS_MICRO;
+	case IIO_CHAN_INFO_OFFSET:
+		mutex_lock(&data->lock);
+		*val = data->magn_offset[MATRIXIO_IMU_AXIS(chan) -
+					 MATRIXIO_IMU_MAGN_FIRST];
+		mutex_unlock(&data->lock);
+		return IIO_VAL_INT;
+	case IIO_CHAN_INFO_SAMP_FREQ:
+		*val = data->samp_freq;
+		return IIO_VAL_INT;
+	case IIO_CHAN_INFO_OVERSAMPLING_RATIO:
+		*val = data->oversampling;
+		return IIO_VAL_INT;
 	default:
 		return -EINVAL;
 	}
@@ -174,8 +635,157 @@ static int matrixio_imu_read_raw(struct iio_dev *indio_dev,
 	return IIO_VAL_INT_PLUS_MICRO;
 }
 
+static irqreturn_t matrixio_imu_trigger_handler(int irq, void *p)
+{
+	struct iio_poll_func *pf = p;
+	struct iio_dev *indio_dev = pf->indio_dev;
+	struct matrixio_bus *data = iio_priv(indio_dev);
+	s64 ts = iio_get_time_ns(indio_dev);
+	__le32 *values;
+	int i, ret;
+
+	mutex_lock(&data->lock);
+
+	ret = matrixio_imu_fetch(data);
+	if (!ret && data->fresh) {
+		data->fresh = false;
+		if (test_bit(MATRIXIO_IMU_QUAT, indio_dev->active_scan_mask)) {
+			matrixio_ahrs_update(data);
+			for (i = 0; i < 4; i++)
+				data->scan.orient.quat[i] = cpu_to_le32(
+				    data->quat[i] << (30 - MATRIXIO_AHRS_SHIFT));
+			values = data->scan.orient.values;
+		} else {
+			values = data->scan.axes.values;
+		}
+		for (i = 0; i < MATRIXIO_IMU_AXES; i++)
+			values[i] = cpu_to_le32(data->values[i]);
+		iio_push_to_buffers_with_timestamp(indio_dev, &data->scan, ts);
+	}
+
+	mutex_unlock(&data->lock);
+
+	iio_trigger_notify_done(indio_dev->trig);
+
+	return IRQ_HANDLED;
+}
+
+static int matrixio_imu_read_avail(struct iio_dev *indio_dev,
+				   struct iio_chan_spec const *chan,
+				   const int **vals, int *type, int *length,
+				   long mask)
+{
+	switch (mask) {
+	case IIO_CHAN_INFO_SAMP_FREQ:
+		*vals = matrixio_imu_samp_freq_avail;
+		*length = ARRAY_SIZE(matrixio_imu_samp_freq_avail);
+		break;
+	case IIO_CHAN_INFO_OVERSAMPLING_RATIO:
+		*vals = matrixio_imu_oversampling_avail;
+		*length = ARRAY_SIZE(matrixio_imu_oversampling_avail);
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	*type = IIO_VAL_INT;
+
+	return IIO_AVAIL_LIST;
+}
+
+static ssize_t matrixio_imu_calibrate_show(struct device *dev,
+					   struct device_attribute *attr,
+					   char *buf)
+{
+	struct matrixio_bus *data = iio_priv(dev_to_iio_dev(dev));
+
+	return sysfs_emit(buf, "%d\n", READ_ONCE(data->calibrating));
+}
+
+/* Writing 1 starts collecting extremes from every fetch, sysfs or buffered,
+ * while the board is turned through all orientations. Writing 0 replaces
+ * the offsets and matrix, or fails with ENODATA if the run was too short. */
+static ssize_t matrixio_imu_calibrate_store(struct device *dev,
+					    struct device_attribute *attr,
+					    const char *buf, size_t len)
+{
+	struct matrixio_bus *data = iio_priv(dev_to_iio_dev(dev));
+	bool enable;
+	int i, ret;
+
+	ret = kstrtobool(buf, &enable);
+	if (ret)
+		return ret;
+
+	mutex_lock(&data->lock);
+	if (enable) {
+		for (i = 0; i < 3; i++) {
+			data->magn_min[i] = S32_MAX;
+			data->magn_max[i] = S32_MIN;
+		}
+		data->calib_samples = 0;
+	} else if (data->calibrating) {
+		ret = matrixio_imu_calib_finish(data);
+	}
+	data->calibrating = enable;
+	mutex_unlock(&data->lock);
+
+	return ret ? ret : len;
+}
+
+/* Row-major, 1000000 is 1.0. Together with in_magn_*_offset this is the
+ * whole calibration, so it can be saved and written back at boot. */
+static ssize_t matrixio_imu_matrix_show(struct device *dev,
+					struct device_attribute *attr, char *buf)
+{
+	struct matrixio_bus *data = iio_priv(dev_to_iio_dev(dev));
+	s32 m[3][3];
+
+	mutex_lock(&data->lock);
+	memcpy(m, data->magn_matrix, sizeof(m));
+	mutex_unlock(&data->lock);
+
+	return sysfs_emit(buf, "%d %d %d %d %d %d %d %d %d\n", m[0][0],
+			  m[0][1], m[0][2], m[1][0], m[1][1], m[1][2], m[2][0],
+			  m[2][1], m[2][2]);
+}
+
+static ssize_t matrixio_imu_matrix_store(struct device *dev,
+					 struct device_attribute *attr,
+					 const char *buf, size_t len)
+{
+	struct matrixio_bus *data = iio_priv(dev_to_iio_dev(dev));
+	s32 m[3][3];
+
+	if (sscanf(buf, "%d %d %d %d %d %d %d %d %d", &m[0][0], &m[0][1],
+		   &m[0][2], &m[1][0], &m[1][1], &m[1][2], &m[2][0], &m[2][1],
+		   &m[2][2]) != 9)
+		return -EINVAL;
+
+	mutex_lock(&data->lock);
+	memcpy(data->magn_matrix, m, sizeof(m));
+	mutex_unlock(&data->lock);
+
+	return len;
+}
+
+static IIO_DEVICE_ATTR(in_magn_calibrate, 0644, matrixio_imu_calibrate_show,
+		       matrixio_imu_calibrate_store, 0);
+static IIO_DEVICE_ATTR(in_magn_soft_iron_matrix, 0644,
+		       matrixio_imu_matrix_show, matrixio_imu_matrix_store, 0);
+
+static struct attribute *matrixio_imu_attrs[] = {
+    &iio_dev_attr_in_magn_calibrate.dev_attr.attr,
+    &iio_dev_attr_in_magn_soft_iron_matrix.dev_attr.attr, NULL};
+
+static const struct attribute_group matrixio_imu_attr_group = {
+    .attrs = matrixio_imu_attrs,
+};
+
 static const struct iio_info matrixio_imu_info = {
     .read_raw = matrixio_imu_read_raw, .write_raw = matrixio_imu_write_raw,
+    .read_avail = matrixio_imu_read_avail,
+    .attrs = &matrixio_imu_attr_group,
     // .driver_module = THIS_MODULE,
 };
 
@@ -183,6 +793,7 @@ static int matrixio_imu_probe(struct platform_device *pdev)
 {
 	struct matrixio_bus *data;
 	struct iio_dev *indio_dev;
+	int i, ret;
 
 	indio_dev = devm_iio_device_alloc(&pdev->dev, sizeof(*data));
 	if (!indio_dev)
@@ -195,6 +806,12 @@ static int matrixio_imu_probe(struct platform_device *pdev)
 	platform_set_drvdata(pdev, indio_dev);
 
 	mutex_init(&data->lock);
+	data->samp_freq = matrixio_imu_samp_freq_avail[
+	    ARRAY_SIZE(matrixio_imu_samp_freq_avail) - 1];
+	data->oversampling = 1;
+	data->quat[0] = MATRIXIO_AHRS_ONE;
+	for (i = 0; i < 3; i++)
+		data->magn_matrix[i][i] = MATRIXIO_IMU_MATRIX_ONE;
 
 	indio_dev->dev.parent = &pdev->dev;
 	indio_dev->info = &matrixio_imu_info;
@@ -202,9 +819,22 @@ static int matrixio_imu_probe(struct platform_device *pdev)
 	indio_dev->num_channels = ARRAY_SIZE(matrixio_imu_channels);
 	indio_dev->name = MATRIXIO_UV_DRV_NAME;
 	indio_dev->modes = INDIO_DIRECT_MODE;
+	indio_dev->available_scan_masks = matrixio_imu_scan_masks;
 
 	data->mio = dev_get_drvdata(pdev->dev.parent);
 
+	ret = devm_iio_triggered_buffer_setup(&pdev->dev, indio_dev, NULL,
+					      matrixio_imu_trigger_handler,
+					      NULL);
+	if (ret) {
+		dev_err(&pdev->dev, "Failed to set up IIO buffer: %d\n", ret);
+		return ret;
+	}
+
+	/* Buffered capture runs off the core's timer trigger by default */
+	if (data->mio->hrtimer_trig)
+		indio_dev->trig = iio_trigger_get(data->mio->hrtimer_trig);
+
 	return iio_device_register(indio_dev);
 }
 
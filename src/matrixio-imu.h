@@ -0,0 +1,11 @@
+#ifndef __MATRIXIO_IMU_H__
+#define __MATRIXIO_IMU_H__
+
+#include "matrixio-core.h"
+
+#if MATRIXIO_KUNIT_VISIBLE
+void matrixio_ahrs_step(s32 *q, const s32 *g, const s32 *acc,
+			const s32 *magn, s32 dt);
+#endif
+
+#endif
@@ -0,0 +1,165 @@
+/*
+ * matrixio-ioctl.h -- ioctl interface of the MATRIX character devices
+ *
+ *  This program is free software; you can redistribute  it and/or modify it
+ *  under  the terms of  the GNU General  Public License as published by the
+ *  Free Software Foundation;  either version 2 of the  License, or (at your
+ *  option) any later version.
+ *
+ * This header is shared with userspace, keep it free of kernel-only types.
+ */
+
+#ifndef __MATRIXIO_IOCTL_H__
+#define __MATRIXIO_IOCTL_H__
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define MATRIXIO_IOC_MAGIC 'M'
+
+/* /dev/matrixio_everloop
+ *
+ * The LED framebuffer can be mmap()ed (one page, 4 bytes per LED).  Changes
+ * made through the mapping reach the FPGA after MATRIXIO_EVERLOOP_IOC_FLUSH
+ * names the LEDs that changed.  fsync() waits for queued flushes to finish.
+ *
+ * write(), FLUSH, fsync() and the LED class devices end a running
+ * animation.  Until then the animation keeps rendering into the
+ * framebuffer, so stop it before storing through the mapping.
+ */
+struct matrixio_everloop_range {
+	__u32 first; /* First LED */
+	__u32 count; /* Number of LEDs */
+};
+
+#define MATRIXIO_EVERLOOP_IOC_FLUSH                                            \
+	_IOW(MATRIXIO_IOC_MAGIC, 0x00, struct matrixio_everloop_range)
+
+/* In-driver animations, rendered at fps frames per second until stopped or
+ * replaced.  Colors are RGBW, like the framebuffer.
+ *
+ * FADE:    the whole ring moves from key i to key i + 1 over key i's duration.
+ * ROTATE:  keys are spread evenly around the ring and blended between each
+ *	    other; the pattern turns once every keys[0].duration_ms.
+ * BREATHE: the whole ring shows key i, brightness rising and falling once
+ *	    over key i's duration.
+ * VU:	    a bar proportional to microphone level, blending from keys[0] at
+ *	    the first LED to keys[1] at the last one.  Needs an open capture
+ *	    stream to move.
+ */
+#define MATRIXIO_EVERLOOP_ANIM_FADE 0
+#define MATRIXIO_EVERLOOP_ANIM_ROTATE 1
+#define MATRIXIO_EVERLOOP_ANIM_BREATHE 2
+#define MATRIXIO_EVERLOOP_ANIM_VU 3
+
+#define MATRIXIO_EVERLOOP_ANIM_KEYS_MAX 16
+
+struct matrixio_everloop_key {
+	__u8 red;
+	__u8 green;
+	__u8 blue;
+	__u8 white;
+	__u32 duration_ms;
+};
+
+struct matrixio_everloop_anim {
+	__u32 effect;
+	__u32 fps;   /* 1 to 100 */
+	__u32 nkeys; /* 1 to MATRIXIO_EVERLOOP_ANIM_KEYS_MAX */
+	__u32 reserved;
+	struct matrixio_everloop_key keys[MATRIXIO_EVERLOOP_ANIM_KEYS_MAX];
+};
+
+#define MATRIXIO_EVERLOOP_IOC_ANIM_START                                       \
+	_IOW(MATRIXIO_IOC_MAGIC, 0x01, struct matrixio_everloop_anim)
+#define MATRIXIO_EVERLOOP_IOC_ANIM_STOP _IO(MATRIXIO_IOC_MAGIC, 0x02)
+
+/* /dev/matrixio_regmap
+ *
+ * MATRIXIO_REGMAP_IOC_BATCH runs up to MATRIXIO_REGMAP_BATCH_MAX accesses in
+ * one call, as a single SPI message.  Each op gets its own status; ops that
+ * fail validation are skipped and the rest still run.
+ */
+#define MATRIXIO_REGMAP_OP_READ 0x0001
+
+struct matrixio_regmap_op {
+	__u16 address; /* FPGA bus address */
+	__u16 flags;   /* MATRIXIO_REGMAP_OP_READ, otherwise a write */
+	__u32 length;  /* In bytes */
+	__u64 data;    /* Userspace buffer */
+	__s32 status;  /* Set by the driver: 0 or -errno */
+	__u32 reserved;
+};
+
+struct matrixio_regmap_batch {
+	__u32 count;
+	__u32 reserved;
+	__u64 ops; /* Array of count struct matrixio_regmap_op */
+};
+
+#define MATRIXIO_REGMAP_BATCH_MAX 256
+
+#define MATRIXIO_REGMAP_IOC_BATCH                                              \
+	_IOWR(MATRIXIO_IOC_MAGIC, 0x10, struct matrixio_regmap_batch)
+
+/* The device can be mmap()ed once per open file, up to
+ * MATRIXIO_REGMAP_MAP_MAX bytes.  MATRIXIO_REGMAP_IOC_XFER then moves data
+ * between the bus and that area without copying through the syscall.
+ */
+#define MATRIXIO_REGMAP_MAP_MAX (1 << 20)
+
+struct matrixio_regmap_xfer {
+	__u16 address; /* FPGA bus address */
+	__u16 flags;   /* MATRIXIO_REGMAP_OP_READ, otherwise a write */
+	__u32 length;  /* In bytes */
+	__u64 offset;  /* Into the mapped area */
+};
+
+#define MATRIXIO_REGMAP_IOC_XFER                                               \
+	_IOW(MATRIXIO_IOC_MAGIC, 0x11, struct matrixio_regmap_xfer)
+
+/* FPGA interrupt sources.  After MATRIXIO_REGMAP_IOC_SUBSCRIBE with a mask of
+ * (1 << event) bits, poll() reports EPOLLPRI once any of them has fired, and
+ * MATRIXIO_REGMAP_IOC_EVENTS returns what fired since the previous call,
+ * blocking until something does unless the file is O_NONBLOCK.  Events are
+ * only raised while the driver owning the interrupt has it enabled, e.g. mic
+ * fragments while a capture stream is open.
+ */
+#define MATRIXIO_EVENT_MIC_FRAGMENT 0
+#define MATRIXIO_EVENT_UART_RX 1
+#define MATRIXIO_EVENT_GPIO 2
+#define MATRIXIO_EVENT_MAX 3
+
+struct matrixio_regmap_events {
+	__u32 mask; /* Subscribed events that fired */
+	__u32 reserved;
+	__u32 count[MATRIXIO_EVENT_MAX]; /* Times each one fired */
+};
+
+#define MATRIXIO_REGMAP_IOC_SUBSCRIBE _IOW(MATRIXIO_IOC_MAGIC, 0x12, __u32)
+#define MATRIXIO_REGMAP_IOC_EVENTS                                             \
+	_IOR(MATRIXIO_IOC_MAGIC, 0x13, struct matrixio_regmap_events)
+
+/* /dev/matrixio_gpio_wave
+ *
+ * write() queues steps of a GPIO waveform, which a real-time kernel thread
+ * plays on the high resolution clock.  Each step waits delay_us after the
+ * previous one, or after the write that found the queue empty, then drives
+ * the lines in mask to value.  Steps with a zero delay go out in the same
+ * bus write as the step before them.  Lines set up as inputs are not
+ * affected.
+ *
+ * write() takes whole steps and blocks while the queue is full unless the
+ * file is O_NONBLOCK; poll() reports POLLOUT once there is room.  fsync()
+ * waits until every queued step has been played.
+ */
+struct matrixio_gpio_step {
+	__u32 delay_us;
+	__u16 mask;
+	__u16 value;
+};
+
+/* Drops the steps not played yet */
+#define MATRIXIO_GPIO_WAVE_IOC_CANCEL _IO(MATRIXIO_IOC_MAGIC, 0x20)
+
+#endif
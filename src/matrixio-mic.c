@@ -14,6 +14,7 @@
 #include <linux/cdev.h>
 #include <linux/fs.h>
 #include <linux/init.h>
+#include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/moduleparam.h>
 #include <linux/of_irq.h>
@@ -70,11 +71,14 @@ static void matrixio_pcm_capture_work(struct work_struct *wk)
 	unsigned long pos;
 	uint16_t *buf;
 	unsigned i, c;
+	u64 energy = 0;
 	int ret;
 
-	ret =
-	    matrixio_read(ms->mio, MATRIXIO_MICARRAY_BASE,
-			  snd_pcm_lib_period_bytes(substream), ms->frag_buffer);
+	ret = matrixio_read(ms->mio, MATRIXIO_MICARRAY_BASE,
+			    min_t(unsigned int, runtime->channels,
+				  MATRIXIO_MIC_CHANNELS) *
+				MATRIXIO_PERIOD_BYTES_PER_CH,
+			    ms->frag_buffer);
 	/* Clear SPI xfer in progress bit */
 	smp_mb__before_atomic();
 	clear_bit(1, &ms->flags);
@@ -96,6 +100,21 @@ static void matrixio_pcm_capture_work(struct work_struct *wk)
 		spin_unlock_irqrestore(&ms->worker_lock, flags);
 		return;
 	}
+	/* Published for the everloop VU meter */
+	for (i = 0; i < MATRIXIO_PERIOD_FRAMES; i++)
+		energy += (s32)(int16_t)ms->frag_buffer[i] *
+			  (int16_t)ms->frag_buffer[i];
+	atomic_set(&ms->mio->mic_level,
+		   int_sqrt64(energy / MATRIXIO_PERIOD_FRAMES));
+
+	/* Channels past the mics are the playback reference for this fragment */
+	if (runtime->channels > MATRIXIO_MIC_CHANNELS)
+		matrixio_loopback_pull(
+		    ms->mio,
+		    &ms->frag_buffer[MATRIXIO_MIC_CHANNELS * MATRIXIO_PERIOD_FRAMES],
+		    &ms->frag_buffer[(MATRIXIO_MIC_CHANNELS + 1) *
+				     MATRIXIO_PERIOD_FRAMES],
+		    MATRIXIO_PERIOD_FRAMES);
 	pos = atomic_read(&ms->position);
 	/* Interleave data from fragment into "dma" buffer */
 	buf = (uint16_t *)(runtime->dma_area + frames_to_bytes(runtime, pos));
@@ -121,6 +140,8 @@ static irqreturn_t matrixio_pcm_interrupt(int irq, void *irq_data)
 	if (ms->substream == NULL)
 		return IRQ_NONE;
 
+	matrixio_notify_event(ms->mio, MATRIXIO_EVENT_MIC_FRAGMENT);
+
 	/* Have we started receive? Device will generate interrupts constantly.
 	 */
 	if (!test_bit(0, &ms->flags))
@@ -205,6 +226,7 @@ static int matrixio_pcm_trigger(struct snd_soc_component *component,
 
 	switch (cmd) {
 	case SNDRV_PCM_TRIGGER_START:
+		matrixio_loopback_sync(ms->mio);
 		set_bit(0, &ms->flags);
 		smp_mb__after_atomic();
 		return 0;
@@ -14,7 +14,10 @@ struct playback_params {
 };
 
 /* Defines for capture parameters */
-#define MATRIXIO_CHANNELS_MAX 8
+#define MATRIXIO_MIC_CHANNELS 8
+/* Two extra capture channels carry the playback loopback (AEC reference) */
+#define MATRIXIO_LOOPBACK_CHANNELS 2
+#define MATRIXIO_CHANNELS_MAX (MATRIXIO_MIC_CHANNELS + MATRIXIO_LOOPBACK_CHANNELS)
 #define MATRIXIO_RATES (SNDRV_PCM_RATE_8000 | SNDRV_PCM_RATE_16000 | \
 		SNDRV_PCM_RATE_22050 | SNDRV_PCM_RATE_32000 | SNDRV_PCM_RATE_44100 | \
 		SNDRV_PCM_RATE_48000 | SNDRV_PCM_RATE_96000)
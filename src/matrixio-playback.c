@@ -127,6 +127,11 @@ static int thread_pcm_playback(void *data)
 				       MATRIXIO_MICARRAY_BUFFER_SIZE,
 				       (void *)matrixio_pb_buf);
 
+			/* FIFO status counts 16-bit samples, two per frame */
+			matrixio_loopback_push(ms->mio, matrixio_pb_buf,
+					       MATRIXIO_MICARRAY_BUFFER_SIZE / 4,
+					       fifo_status / 2);
+
 			ms->position += MATRIXIO_MICARRAY_BUFFER_SIZE;
 
 			snd_pcm_period_elapsed(ms->substream);
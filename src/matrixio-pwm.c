@@ -1,7 +1,9 @@
 #include "matrixio-compat.h"
 #include <linux/fs.h>
 #include <linux/init.h>
+#include <linux/math64.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/platform_device.h>
 #include <linux/pwm.h>
 
@@ -9,72 +11,278 @@
 
 #define NUM_PWM 16
 
+/* The 16 GPIO lines are grouped in 4 banks, each with one timer whose
+ * period and prescaler all 4 channels of the bank share. */
+#define MATRIXIO_PWM_BANKS 4
+#define MATRIXIO_PWM_BANK_SIZE 4
+
+#define MATRIXIO_PWM_FUNCTION (MATRIXIO_GPIO_BASE + 2) /* 1: line is PWM */
+#define MATRIXIO_PWM_PRESCALER (MATRIXIO_GPIO_BASE + 3) /* 4 bits per bank */
+#define MATRIXIO_PWM_BANK(b) (MATRIXIO_GPIO_BASE + 4 + (b) * 6)
+#define MATRIXIO_PWM_PERIOD(b) (MATRIXIO_PWM_BANK(b) + 1)
+#define MATRIXIO_PWM_DUTY(b, c) (MATRIXIO_PWM_BANK(b) + 2 + (c))
+
+#define MATRIXIO_PWM_PRESCALER_MAX 15
+#define MATRIXIO_PWM_COUNT_MAX 0xffff
+
 struct matrixio_pwm_chip {
-	struct matrixio *mio;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 9, 0)
 	struct pwm_chip chip;
+#endif
+	struct matrixio *mio;
+	struct mutex lock; /* Serializes apply() against the shadows below */
+	/* Shadows of the timer registers, only this driver writes them */
+	u16 function;
+	u16 prescaler;
+	u16 period[MATRIXIO_PWM_BANKS];
+	u16 duty[NUM_PWM];
 };
 
 static inline struct matrixio_pwm_chip *to_matrixio(struct pwm_chip *chip)
 {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+	return pwmchip_get_drvdata(chip);
+#else
 	return container_of(chip, struct matrixio_pwm_chip, chip);
+#endif
 }
 
-static int matrixio_pwm_request(struct pwm_chip *chip, struct pwm_device *pwm)
+static unsigned int matrixio_pwm_bank_prescaler(struct matrixio_pwm_chip *mp,
+						unsigned int bank)
 {
-	MATRIXIO_REMOVE_RETURN();
+	return (mp->prescaler >> (bank * 4)) & 0xf;
 }
 
-static void matrixio_pwm_free(struct pwm_chip *chip, struct pwm_device *pwm) {}
+/* Each timer count lasts two prescaled FPGA clocks */
+static u64 matrixio_pwm_to_ns(struct matrixio_pwm_chip *mp, u16 count,
+			      unsigned int prescaler)
+{
+	return DIV_ROUND_UP_ULL((u64)count * (2 << prescaler) * NSEC_PER_SEC,
+				mp->mio->fpga_clock);
+}
 
-static int matrixio_pwm_enable(struct pwm_chip *chip, struct pwm_device *pwm)
+static void matrixio_pwm_add_write(struct matrixio_xfer *xfers, u16 *regs,
+				   unsigned int *n, unsigned int add, u16 value)
 {
-	MATRIXIO_REMOVE_RETURN();
+	regs[*n] = value;
+	xfers[*n].add = add;
+	xfers[*n].length = sizeof(regs[*n]);
+	xfers[*n].data = &regs[*n];
+	xfers[*n].read = false;
+	(*n)++;
 }
 
-static void matrixio_pwm_disable(struct pwm_chip *chip, struct pwm_device *pwm)
+/* A state change is a single SPI message touching only what changed, plus
+ * a direction write if an enabled line was still an input */
+static int matrixio_pwm_apply(struct pwm_chip *chip, struct pwm_device *pwm,
+			      const struct pwm_state *state)
 {
+	struct matrixio_pwm_chip *mp = to_matrixio(chip);
+	unsigned int bank = pwm->hwpwm / MATRIXIO_PWM_BANK_SIZE;
+	unsigned int channel = pwm->hwpwm % MATRIXIO_PWM_BANK_SIZE;
+	u16 bank_mask = 0xf << (bank * MATRIXIO_PWM_BANK_SIZE);
+	struct matrixio_xfer xfers[4];
+	u16 regs[4], function, prescaler;
+	u64 ticks, period, duty;
+	unsigned int presc, n = 0;
+	int ret;
+
+	if (state->polarity != PWM_POLARITY_NORMAL)
+		return -EINVAL;
+
+	mutex_lock(&mp->lock);
+
+	function = mp->function;
+	prescaler = mp->prescaler;
+	period = mp->period[bank];
+	duty = mp->duty[pwm->hwpwm];
+
+	if (!state->enabled) {
+		function &= ~BIT(pwm->hwpwm);
+		goto write;
+	}
+
+	ticks = mul_u64_u32_div(state->period, mp->mio->fpga_clock,
+				2 * NSEC_PER_SEC);
+	for (presc = 0; presc < MATRIXIO_PWM_PRESCALER_MAX &&
+			(ticks >> presc) > MATRIXIO_PWM_COUNT_MAX;
+	     presc++)
+		;
+	/* Longer periods than the timer can count are rounded down */
+	period = min_t(u64, ticks >> presc, MATRIXIO_PWM_COUNT_MAX);
+	if (!period) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if ((mp->function & bank_mask & ~BIT(pwm->hwpwm)) &&
+	    (presc != matrixio_pwm_bank_prescaler(mp, bank) ||
+	     period != mp->period[bank])) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	duty = MATRIXIO_MUL_U64_U64_DIV_U64(
+	    min(state->duty_cycle, state->period), period, state->period);
+
+	prescaler &= ~(0xf << (bank * 4));
+	prescaler |= presc << (bank * 4);
+	function |= BIT(pwm->hwpwm);
+
+write:
+	memset(xfers, 0, sizeof(xfers));
+	if (prescaler != mp->prescaler)
+		matrixio_pwm_add_write(xfers, regs, &n, MATRIXIO_PWM_PRESCALER,
+				       prescaler);
+	if (period != mp->period[bank])
+		matrixio_pwm_add_write(xfers, regs, &n,
+				       MATRIXIO_PWM_PERIOD(bank), period);
+	if (duty != mp->duty[pwm->hwpwm])
+		matrixio_pwm_add_write(xfers, regs, &n,
+				       MATRIXIO_PWM_DUTY(bank, channel), duty);
+	if (function != mp->function)
+		matrixio_pwm_add_write(xfers, regs, &n, MATRIXIO_PWM_FUNCTION,
+				       function);
+
+	/* Like the HAL, make the line an output before the timer drives it.
+	 * matrixio-gpio owns the direction register, so it goes through
+	 * there to keep its shadow right. */
+	if (state->enabled) {
+		ret = matrixio_gpio_set_output(mp->mio, pwm->hwpwm);
+		if (ret)
+			goto out;
+	}
+
+	ret = n ? matrixio_xfer_batch(mp->mio, xfers, n) : 0;
+	if (!ret) {
+		mp->function = function;
+		mp->prescaler = prescaler;
+		mp->period[bank] = period;
+		mp->duty[pwm->hwpwm] = duty;
+	}
+
+out:
+	mutex_unlock(&mp->lock);
+
+	return ret;
 }
 
-static int matrixio_pwm_config(struct pwm_chip *chip, struct pwm_device *pwm,
-			       int duty_ns, int period_ns)
+static MATRIXIO_PWM_GET_STATE_TYPE
+matrixio_pwm_get_state(struct pwm_chip *chip, struct pwm_device *pwm,
+		       struct pwm_state *state)
 {
-	MATRIXIO_REMOVE_RETURN();
+	struct matrixio_pwm_chip *mp = to_matrixio(chip);
+	unsigned int bank = pwm->hwpwm / MATRIXIO_PWM_BANK_SIZE;
+	unsigned int presc;
+
+	mutex_lock(&mp->lock);
+
+	presc = matrixio_pwm_bank_prescaler(mp, bank);
+	state->enabled = !!(mp->function & BIT(pwm->hwpwm));
+	state->polarity = PWM_POLARITY_NORMAL;
+	state->period = matrixio_pwm_to_ns(mp, mp->period[bank], presc);
+	state->duty_cycle = matrixio_pwm_to_ns(
+	    mp, min(mp->duty[pwm->hwpwm], mp->period[bank]), presc);
+
+	mutex_unlock(&mp->lock);
+
+	MATRIXIO_PWM_GET_STATE_RETURN();
 }
 
 static const struct pwm_ops matrixio_pwm_ops = {
-    .request = matrixio_pwm_request,
-    .free = matrixio_pwm_free,
-    .config = matrixio_pwm_config,
-    .enable = matrixio_pwm_enable,
-    .disable = matrixio_pwm_disable,
+    .apply = matrixio_pwm_apply,
+    .get_state = matrixio_pwm_get_state,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 7, 0)
     .owner = THIS_MODULE,
+#endif
 };
 
-static int matrixio_pwm_probe(struct platform_device *pdev)
+/* Fills the shadows from the FPGA so get_state() needs no bus traffic */
+static int matrixio_pwm_read_state(struct matrixio_pwm_chip *mp)
+{
+	u16 regs[2 + MATRIXIO_PWM_BANK_SIZE];
+	unsigned int bank;
+	int ret;
+
+	ret = matrixio_read(mp->mio, MATRIXIO_PWM_FUNCTION, 2 * sizeof(u16),
+			    regs);
+	if (ret)
+		return ret;
+
+	mp->function = regs[0];
+	mp->prescaler = regs[1];
+
+	for (bank = 0; bank < MATRIXIO_PWM_BANKS; bank++) {
+		ret = matrixio_read(mp->mio, MATRIXIO_PWM_PERIOD(bank),
+				    sizeof(u16) * (1 + MATRIXIO_PWM_BANK_SIZE),
+				    regs);
+		if (ret)
+			return ret;
+
+		mp->period[bank] = regs[0];
+		memcpy(&mp->duty[bank * MATRIXIO_PWM_BANK_SIZE], &regs[1],
+		       sizeof(u16) * MATRIXIO_PWM_BANK_SIZE);
+	}
+
+	return 0;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 9, 0)
+static void matrixio_pwm_chip_remove(void *chip)
 {
+	pwmchip_remove(chip);
+}
+#endif
 
+static int matrixio_pwm_probe(struct platform_device *pdev)
+{
 	struct matrixio_pwm_chip *matrixio_pwm;
+	struct pwm_chip *chip;
+	int ret;
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+	chip = devm_pwmchip_alloc(&pdev->dev, NUM_PWM, sizeof(*matrixio_pwm));
+	if (IS_ERR(chip))
+		return PTR_ERR(chip);
+	matrixio_pwm = to_matrixio(chip);
+#else
 	matrixio_pwm =
 	    devm_kzalloc(&pdev->dev, sizeof(*matrixio_pwm), GFP_KERNEL);
 	if (!matrixio_pwm)
 		return -ENOMEM;
 
-	matrixio_pwm->chip.dev = &pdev->dev;
-	matrixio_pwm->chip.ops = &matrixio_pwm_ops;
-	matrixio_pwm->chip.npwm = NUM_PWM;
-	matrixio_pwm->chip.base = -1;
+	chip = &matrixio_pwm->chip;
+	chip->dev = &pdev->dev;
+	chip->npwm = NUM_PWM;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 17, 0)
+	chip->base = -1;
+#endif
+#endif
+	chip->ops = &matrixio_pwm_ops;
 
-	platform_set_drvdata(pdev, matrixio_pwm);
+	matrixio_pwm->mio = dev_get_drvdata(pdev->dev.parent);
+	mutex_init(&matrixio_pwm->lock);
 
-	return pwmchip_add(&matrixio_pwm->chip);
-}
+	ret = matrixio_pwm_read_state(matrixio_pwm);
+	if (ret) {
+		dev_err(&pdev->dev, "Could not read PWM state, %d\n", ret);
+		return ret;
+	}
 
-static MATRIXIO_REMOVE_RETURN_TYPE matrixio_pwm_remove(struct platform_device *pdev)
-{
-	struct matrixio_pwm_chip *matrixio_pwm = platform_get_drvdata(pdev);
+	platform_set_drvdata(pdev, matrixio_pwm);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+	ret = devm_pwmchip_add(&pdev->dev, chip);
+#else
+	ret = pwmchip_add(chip);
+	if (!ret)
+		ret = devm_add_action_or_reset(&pdev->dev,
+					       matrixio_pwm_chip_remove, chip);
+#endif
+	if (ret)
+		dev_err(&pdev->dev, "Could not register pwmchip, %d\n", ret);
 
-	return pwmchip_remove(&matrixio_pwm->chip);
+	return ret;
 }
 
 static struct platform_driver matrixio_pwm_driver = {
@@ -83,7 +291,6 @@ static struct platform_driver matrixio_pwm_driver = {
 	    .name = "matrixio-pwm",
 	},
     .probe = matrixio_pwm_probe,
-    .remove = matrixio_pwm_remove,
 };
 
 module_platform_driver(matrixio_pwm_driver);
@@ -3,11 +3,17 @@
 #include <linux/fs.h>
 #include <linux/init.h>
 #include <linux/kernel.h>
+#include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/platform_device.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/vmalloc.h>
 
 #include "matrixio-core.h"
+#include "matrixio-ioctl.h"
 
 struct regmap_data {
 	struct matrixio *mio;
@@ -18,13 +24,43 @@ struct regmap_data {
 	int major;
 };
 
+/* State of one open file.  Each has its own bounce buffer so that clients
+ * on different files no longer share one, and only meet at the bus lock. */
+struct regmap_client {
+	struct regmap_data *rd;
+	struct mutex lock; /* Serializes ioctls on this file */
+	void *buf;
+	size_t size;
+	void *area; /* mmap()ed transfer area, lives until release */
+	size_t area_size;
+	u32 subscribed;			/* Mask of MATRIXIO_EVENT_* bits */
+	int seen[MATRIXIO_EVENT_MAX];	/* Event counts already reported */
+};
+
 int matrixio_regmap_open(struct inode *inode, struct file *filp)
 {
+	struct regmap_client *client;
 
-	struct regmap_data *el;
-	el = container_of(inode->i_cdev, struct regmap_data, cdev);
+	client = kzalloc(sizeof(*client), GFP_KERNEL);
+	if (client == NULL)
+		return -ENOMEM;
+
+	client->rd = container_of(inode->i_cdev, struct regmap_data, cdev);
+	mutex_init(&client->lock);
+
+	filp->private_data = client; /* For use elsewhere */
+
+	return 0;
+}
 
-	filp->private_data = el; /* For use elsewhere */
+static int matrixio_regmap_release(struct inode *inode, struct file *filp)
+{
+	struct regmap_client *client = filp->private_data;
+
+	mutex_destroy(&client->lock);
+	vfree(client->area);
+	kvfree(client->buf);
+	kfree(client);
 
 	return 0;
 }
@@ -32,41 +68,444 @@ int matrixio_regmap_open(struct inode *inode, struct file *filp)
 #define WR_VALUE 1200
 #define RD_VALUE 1201
 
+/* The FPGA bus address is 15 bits wide */
+#define MATRIXIO_REGMAP_MAX_ADDR 0x7fff
+/* Same limit as the old static buffer: 12000 words less the header */
+#define MATRIXIO_REGMAP_MAX_XFER ((12000 - 2) * sizeof(int32_t))
+
+/* Each address holds 16 bits, so length bytes from add span
+ * DIV_ROUND_UP(length, 2) addresses, all of which must be on the bus */
+static bool matrixio_regmap_in_window(loff_t add, size_t length)
+{
+	return add >= 0 && add <= MATRIXIO_REGMAP_MAX_ADDR &&
+	       DIV_ROUND_UP(length, 2) <= MATRIXIO_REGMAP_MAX_ADDR + 1 - add;
+}
+
+/* Caller holds client->lock */
+static void *matrixio_regmap_client_buf(struct regmap_client *client,
+					size_t size)
+{
+	if (size <= client->size)
+		return client->buf;
+
+	kvfree(client->buf);
+	client->buf = kvmalloc(size, GFP_KERNEL);
+	client->size = client->buf ? size : 0;
+
+	return client->buf;
+}
+
+static long matrixio_regmap_batch(struct regmap_client *client,
+				  struct matrixio_regmap_batch __user *arg)
+{
+	struct matrixio_regmap_batch batch;
+	struct matrixio_regmap_op *ops;
+	struct matrixio_xfer *xfers;
+	int *index; /* ops entry of each xfer */
+	size_t total = 0;
+	int i, n = 0, ret;
+	u8 *buf;
+
+	if (copy_from_user(&batch, arg, sizeof(batch)))
+		return -EFAULT;
+
+	if (batch.count > MATRIXIO_REGMAP_BATCH_MAX)
+		return -EINVAL;
+
+	if (batch.count == 0)
+		return 0;
+
+	ops = memdup_user(u64_to_user_ptr(batch.ops),
+			  batch.count * sizeof(*ops));
+	if (IS_ERR(ops))
+		return PTR_ERR(ops);
+
+	xfers = kcalloc(batch.count, sizeof(*xfers), GFP_KERNEL);
+	index = kcalloc(batch.count, sizeof(*index), GFP_KERNEL);
+	if (!xfers || !index) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	for (i = 0; i < batch.count; i++) {
+		if (!matrixio_regmap_in_window(ops[i].address,
+					       ops[i].length) ||
+		    ops[i].length > MATRIXIO_REGMAP_MAX_XFER - total ||
+		    ops[i].flags & ~MATRIXIO_REGMAP_OP_READ) {
+			ops[i].status = -EINVAL;
+			continue;
+		}
+		ops[i].status = 0;
+		total += ops[i].length;
+	}
+
+	mutex_lock(&client->lock);
+
+	buf = matrixio_regmap_client_buf(client, total);
+	if (buf == NULL && total) {
+		ret = -ENOMEM;
+		goto out_unlock;
+	}
+
+	for (i = 0; i < batch.count; i++) {
+		if (ops[i].status)
+			continue;
+
+		xfers[n].add = ops[i].address;
+		xfers[n].length = ops[i].length;
+		xfers[n].data = buf;
+		xfers[n].read = ops[i].flags & MATRIXIO_REGMAP_OP_READ;
+
+		if (!xfers[n].read &&
+		    copy_from_user(buf, u64_to_user_ptr(ops[i].data),
+				   ops[i].length)) {
+			ops[i].status = -EFAULT;
+			continue;
+		}
+
+		buf += ops[i].length;
+		index[n++] = i;
+	}
+
+	ret = matrixio_xfer_batch(client->rd->mio, xfers, n);
+
+	for (i = 0; i < n; i++) {
+		if (ret)
+			ops[index[i]].status = ret;
+		else if (xfers[i].read &&
+			 copy_to_user(u64_to_user_ptr(ops[index[i]].data),
+				      xfers[i].data, xfers[i].length))
+			ops[index[i]].status = -EFAULT;
+	}
+
+	ret = 0;
+	if (copy_to_user(u64_to_user_ptr(batch.ops), ops,
+			 batch.count * sizeof(*ops)))
+		ret = -EFAULT;
+
+out_unlock:
+	mutex_unlock(&client->lock);
+out_free:
+	kfree(index);
+	kfree(xfers);
+	kfree(ops);
+	return ret;
+}
+
+static long matrixio_regmap_xfer(struct regmap_client *client,
+				 struct matrixio_regmap_xfer __user *arg)
+{
+	struct matrixio_regmap_xfer xfer;
+	void *data;
+	long ret;
+
+	if (copy_from_user(&xfer, arg, sizeof(xfer)))
+		return -EFAULT;
+
+	if (!matrixio_regmap_in_window(xfer.address, xfer.length) ||
+	    xfer.flags & ~MATRIXIO_REGMAP_OP_READ)
+		return -EINVAL;
+
+	mutex_lock(&client->lock);
+
+	if (xfer.offset > client->area_size ||
+	    xfer.length > client->area_size - xfer.offset) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* Large transfers go straight between the SPI controller and the
+	 * mapped pages */
+	data = client->area + xfer.offset;
+	if (xfer.flags & MATRIXIO_REGMAP_OP_READ)
+		ret = matrixio_read(client->rd->mio, xfer.address, xfer.length,
+				    data);
+	else
+		ret = matrixio_write(client->rd->mio, xfer.address,
+				     xfer.length, data);
+
+out:
+	mutex_unlock(&client->lock);
+	return ret;
+}
+
+static int matrixio_regmap_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct regmap_client *client = file->private_data;
+	size_t size = vma->vm_end - vma->vm_start;
+	int ret;
+
+	if (vma->vm_pgoff || size > MATRIXIO_REGMAP_MAP_MAX)
+		return -EINVAL;
+
+	mutex_lock(&client->lock);
+
+	if (client->area == NULL) {
+		client->area = vmalloc_user(size);
+		if (client->area == NULL) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		client->area_size = size;
+	} else if (size != client->area_size) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	ret = remap_vmalloc_range(vma, client->area, 0);
+
+out:
+	mutex_unlock(&client->lock);
+	return ret;
+}
+
+/* read()/write() and their io_uring forms address the bus through the file
+ * position: the offset is the FPGA address, and it advances by one address
+ * per 16-bit word moved.  Every transfer sleeps in spi_sync(), so the file
+ * does not claim FMODE_NOWAIT and io_uring runs these from its workers.  An
+ * IOCB_NOWAIT request that still gets here is refused with -EAGAIN. */
+static ssize_t matrixio_regmap_read_iter(struct kiocb *iocb,
+					 struct iov_iter *to)
+{
+	struct regmap_client *client = iocb->ki_filp->private_data;
+	size_t length = iov_iter_count(to);
+	void *buf;
+	int ret;
+
+	if (iocb->ki_flags & IOCB_NOWAIT)
+		return -EAGAIN;
+
+	if (iocb->ki_pos < 0 || iocb->ki_pos > MATRIXIO_REGMAP_MAX_ADDR)
+		return -EINVAL;
+
+	/* Stop short at the top of the bus like at the end of a file */
+	length = min_t(size_t, length, MATRIXIO_REGMAP_MAX_XFER);
+	length = min_t(size_t, length,
+		       (MATRIXIO_REGMAP_MAX_ADDR + 1 - iocb->ki_pos) * 2);
+	if (!length)
+		return 0;
+
+	buf = kvmalloc(length, GFP_KERNEL);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	ret = matrixio_read(client->rd->mio, iocb->ki_pos, length, buf);
+
+	if (!ret && copy_to_iter(buf, length, to) != length)
+		ret = -EFAULT;
+
+	kvfree(buf);
+
+	if (ret)
+		return ret;
+
+	iocb->ki_pos += DIV_ROUND_UP(length, 2);
+	return length;
+}
+
+static ssize_t matrixio_regmap_write_iter(struct kiocb *iocb,
+					  struct iov_iter *from)
+{
+	struct regmap_client *client = iocb->ki_filp->private_data;
+	size_t length = iov_iter_count(from);
+	void *buf;
+	int ret;
+
+	if (iocb->ki_flags & IOCB_NOWAIT)
+		return -EAGAIN;
+
+	if (iocb->ki_pos < 0 || iocb->ki_pos > MATRIXIO_REGMAP_MAX_ADDR)
+		return -EINVAL;
+
+	/* Stop short at the top of the bus like at the end of a file */
+	length = min_t(size_t, length, MATRIXIO_REGMAP_MAX_XFER);
+	length = min_t(size_t, length,
+		       (MATRIXIO_REGMAP_MAX_ADDR + 1 - iocb->ki_pos) * 2);
+	if (!length)
+		return 0;
+
+	buf = kvmalloc(length, GFP_KERNEL);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	if (copy_from_iter(buf, length, from) != length)
+		ret = -EFAULT;
+	else
+		ret = matrixio_write(client->rd->mio, iocb->ki_pos, length,
+				     buf);
+
+	kvfree(buf);
+
+	if (ret)
+		return ret;
+
+	iocb->ki_pos += DIV_ROUND_UP(length, 2);
+	return length;
+}
+
+/* Fills in what fired since the last report, returns true if anything did */
+static bool matrixio_regmap_events_pending(struct regmap_client *client,
+					   struct matrixio_regmap_events *ev)
+{
+	struct matrixio *mio = client->rd->mio;
+	int i, count;
+
+	memset(ev, 0, sizeof(*ev));
+	for (i = 0; i < MATRIXIO_EVENT_MAX; i++) {
+		if (!(client->subscribed & BIT(i)))
+			continue;
+		count = atomic_read(&mio->events[i]);
+		if (count != client->seen[i]) {
+			ev->mask |= BIT(i);
+			ev->count[i] = count - client->seen[i];
+		}
+	}
+
+	return ev->mask != 0;
+}
+
+static long matrixio_regmap_events(struct regmap_client *client,
+				   struct file *file,
+				   struct matrixio_regmap_events __user *arg)
+{
+	struct matrixio *mio = client->rd->mio;
+	struct matrixio_regmap_events ev;
+	int i, ret;
+
+	/* Don't hold the client lock while sleeping, it would stall every
+	 * other ioctl on this file */
+	for (;;) {
+		mutex_lock(&client->lock);
+		if (!client->subscribed) {
+			mutex_unlock(&client->lock);
+			return -EINVAL;
+		}
+		if (matrixio_regmap_events_pending(client, &ev))
+			break;
+		mutex_unlock(&client->lock);
+
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		ret = wait_event_interruptible(
+		    mio->event_wait, matrixio_regmap_events_pending(client, &ev));
+		if (ret)
+			return ret;
+	}
+
+	for (i = 0; i < MATRIXIO_EVENT_MAX; i++)
+		client->seen[i] += ev.count[i];
+	mutex_unlock(&client->lock);
+
+	if (copy_to_user(arg, &ev, sizeof(ev)))
+		return -EFAULT;
+
+	return 0;
+}
+
+static __poll_t matrixio_regmap_poll(struct file *file,
+				     struct poll_table_struct *wait)
+{
+	struct regmap_client *client = file->private_data;
+	struct matrixio_regmap_events ev;
+
+	poll_wait(file, &client->rd->mio->event_wait, wait);
+
+	return matrixio_regmap_events_pending(client, &ev) ? EPOLLPRI : 0;
+}
+
 static long matrixio_regmap_ioctl(struct file *file, unsigned int cmd,
 				  unsigned long arg)
 {
-	struct regmap_data *el = file->private_data;
-	int32_t *user_buffer;
-	static int32_t data[12000];
+	struct regmap_client *client = file->private_data;
+	int32_t __user *user_buffer = (int32_t __user *)arg;
+	int32_t header[2]; /* FPGA address, length in bytes */
+	void *buf;
+	long ret = -EINVAL;
 
-	switch (cmd) {
-	case WR_VALUE:
-		user_buffer = (int32_t *)arg;
-		if (copy_from_user(data, user_buffer, sizeof(int32_t) * 2))
-			return -EFAULT;
+	if (cmd == MATRIXIO_REGMAP_IOC_BATCH)
+		return matrixio_regmap_batch(client, (void __user *)arg);
 
-		if (copy_from_user(&data[2], user_buffer + 2, data[1]))
-			return -EFAULT;
+	if (cmd == MATRIXIO_REGMAP_IOC_XFER)
+		return matrixio_regmap_xfer(client, (void __user *)arg);
 
-		return matrixio_write(el->mio, data[0], data[1],
-				      (void *)&data[2]);
+	if (cmd == MATRIXIO_REGMAP_IOC_EVENTS)
+		return matrixio_regmap_events(client, file, (void __user *)arg);
 
-	case RD_VALUE:
-		user_buffer = (int32_t *)arg;
-		if (copy_from_user(data, user_buffer, sizeof(int32_t) * 2))
-			return -EFAULT;
+	if (cmd == MATRIXIO_REGMAP_IOC_SUBSCRIBE) {
+		u32 mask;
+		int i;
 
-		matrixio_read(el->mio, data[0], data[1], (void *)&data[2]);
-		if (copy_to_user(user_buffer + 2, &data[2], data[1]))
+		if (get_user(mask, (u32 __user *)arg))
 			return -EFAULT;
+		if (mask & ~GENMASK(MATRIXIO_EVENT_MAX - 1, 0))
+			return -EINVAL;
+
+		/* Only events from now on count */
+		mutex_lock(&client->lock);
+		client->subscribed = mask;
+		for (i = 0; i < MATRIXIO_EVENT_MAX; i++)
+			client->seen[i] =
+			    atomic_read(&client->rd->mio->events[i]);
+		mutex_unlock(&client->lock);
 		return 0;
 	}
-	return -EINVAL;
+
+	if (cmd != WR_VALUE && cmd != RD_VALUE)
+		return -EINVAL;
+
+	if (copy_from_user(header, user_buffer, sizeof(header)))
+		return -EFAULT;
+
+	if (header[0] < 0 || header[0] > MATRIXIO_REGMAP_MAX_ADDR ||
+	    header[1] < 0 || header[1] > MATRIXIO_REGMAP_MAX_XFER)
+		return -EINVAL;
+
+	if (header[1] == 0)
+		return 0;
+
+	mutex_lock(&client->lock);
+
+	buf = matrixio_regmap_client_buf(client, header[1]);
+	if (buf == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	switch (cmd) {
+	case WR_VALUE:
+		if (copy_from_user(buf, user_buffer + 2, header[1])) {
+			ret = -EFAULT;
+			break;
+		}
+
+		ret = matrixio_write(client->rd->mio, header[0], header[1], buf);
+		break;
+
+	case RD_VALUE:
+		ret = matrixio_read(client->rd->mio, header[0], header[1], buf);
+		if (ret)
+			break;
+
+		if (copy_to_user(user_buffer + 2, buf, header[1]))
+			ret = -EFAULT;
+		break;
+	}
+
+out:
+	mutex_unlock(&client->lock);
+	return ret;
 }
 
 struct file_operations matrixio_regmap_file_operations = {
     .owner = THIS_MODULE,
     .open = matrixio_regmap_open,
+    .release = matrixio_regmap_release,
+    .llseek = default_llseek,
+    .read_iter = matrixio_regmap_read_iter,
+    .write_iter = matrixio_regmap_write_iter,
+    .mmap = matrixio_regmap_mmap,
+    .poll = matrixio_regmap_poll,
     .unlocked_ioctl = matrixio_regmap_ioctl};
 
 static int matrixio_regmap_uevent(struct device *dev, struct kobj_uevent_env *env)
@@ -1,8 +1,10 @@
 #include <linux/delay.h>
 #include <linux/freezer.h>
+#include <linux/idr.h>
 #include <linux/init.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/of.h>
 #include <linux/of_address.h>
 #include <linux/of_device.h>
@@ -16,12 +18,21 @@
 #include "matrixio-core.h"
 #include "matrixio-compat.h"
 
-static struct matrixio *matrixio;
-static struct uart_port port;
-static int irq;
-static struct workqueue_struct *workqueue;
-static struct work_struct work;
-static spinlock_t conf_lock;
+#define MATRIXIO_UART_MAX_PORTS 4
+
+struct matrixio_uart {
+	struct uart_port port;
+	struct matrixio *mio;
+	unsigned int base; /* FPGA address of this UART block */
+	struct workqueue_struct *workqueue;
+	struct work_struct rx_work;
+	struct work_struct tx_work;
+	struct mutex conf_lock; /* Serializes UART register accesses */
+};
+
+#define to_matrixio_uart(p) container_of(p, struct matrixio_uart, port)
+
+static DEFINE_IDA(matrixio_uart_ida);
 
 struct matrixio_uart_status {
 	uint8_t dummy : 8;
@@ -35,34 +46,118 @@ struct matrixio_uart_data {
 	uint8_t empty;
 };
 
+#define MATRIXIO_UART_FIFO_SIZE 16
+
+/* A busy transmitter that has not gone idle after this long is stuck */
+#define MATRIXIO_UART_TX_TIMEOUT_MS 100
+
+/* Register offsets from the UART block base */
+#define MATRIXIO_UART_DATA 0x000
+#define MATRIXIO_UART_STATUS 0x100
+#define MATRIXIO_UART_TX 0x101
+#define MATRIXIO_UART_UCR 0x102
+
+/* Neither the driver nor the HAL knows of baud rate or line control
+ * registers in the UART block, so termios changes are not supported.  The
+ * line is reported as 115200 8N1, an assumption that is not read from or
+ * verified against the hardware. */
+#define MATRIXIO_UART_BAUD 115200
+
 static const char driver_name[] = "ttyMATRIX";
 static const char tty_dev_name[] = "ttyMATRIX";
 
 static irqreturn_t uart_rxint(int irq, void *dev_id)
 {
+	struct matrixio_uart *mu = dev_id;
+
+	matrixio_notify_event(mu->mio, MATRIXIO_EVENT_UART_RX);
 	if (!freezing(current))
-		queue_work(workqueue, &work);
+		queue_work(mu->workqueue, &mu->rx_work);
 	return IRQ_HANDLED;
 }
 
+/* Every read of the data register pops one character, so read a FIFO's worth
+ * per SPI message and keep going until the FIFO reports empty. */
 static void matrixio_uart_work(struct work_struct *w)
 {
-	struct matrixio_uart_data uart_data;
+	struct matrixio_uart *mu = container_of(w, struct matrixio_uart, rx_work);
+	struct uart_port *port = &mu->port;
+	struct matrixio_uart_data uart_data[MATRIXIO_UART_FIFO_SIZE];
+	struct matrixio_xfer xfers[MATRIXIO_UART_FIFO_SIZE];
+	unsigned char chars[MATRIXIO_UART_FIFO_SIZE];
+	int i, n, copied, total = 0, ret;
+
+	memset(xfers, 0, sizeof(xfers));
+	for (i = 0; i < MATRIXIO_UART_FIFO_SIZE; i++) {
+		xfers[i].add = mu->base + MATRIXIO_UART_DATA;
+		xfers[i].length = sizeof(uart_data[i]);
+		xfers[i].data = &uart_data[i];
+		xfers[i].read = true;
+	}
 
-	spin_lock_irq(&conf_lock);
-	matrixio_read(matrixio, MATRIXIO_UART_BASE, sizeof(uart_data),
-		      (void *)&uart_data);
+	do {
+		mutex_lock(&mu->conf_lock);
+		ret = matrixio_xfer_batch(mu->mio, xfers,
+					  MATRIXIO_UART_FIFO_SIZE);
+		mutex_unlock(&mu->conf_lock);
+		if (ret) {
+			dev_err_ratelimited(port->dev, "RX failed (%d)\n", ret);
+			break;
+		}
 
-	if (!uart_data.empty) {
-		tty_insert_flip_char(&port.state->port,
-				     (unsigned int)uart_data.uart_rx,
-				     TTY_NORMAL);
-		tty_flip_buffer_push(&port.state->port);
-	}
-	spin_unlock_irq(&conf_lock);
+		for (i = 0, n = 0; i < MATRIXIO_UART_FIFO_SIZE; i++)
+			if (!uart_data[i].empty)
+				chars[n++] = uart_data[i].uart_rx;
+
+		copied = tty_insert_flip_string(&port->state->port, chars, n);
+
+		spin_lock_irq(&port->lock);
+		port->icount.rx += copied;
+		/* The status register has no overrun flag, so only losses in
+		 * the tty layer can be counted */
+		port->icount.buf_overrun += n - copied;
+		spin_unlock_irq(&port->lock);
+
+		total += n;
+	} while (n == MATRIXIO_UART_FIFO_SIZE && total < UART_XMIT_SIZE);
+
+	if (total)
+		tty_flip_buffer_push(&port->state->port);
+}
+
+static int matrixio_uart_read_status(struct matrixio_uart *mu,
+				     struct matrixio_uart_status *status)
+{
+	int ret;
+
+	mutex_lock(&mu->conf_lock);
+	ret = matrixio_read(mu->mio, mu->base + MATRIXIO_UART_STATUS,
+			    sizeof(*status), (void *)status);
+	mutex_unlock(&mu->conf_lock);
+
+	return ret;
 }
 
-static unsigned int matrixio_uart_tx_empty(struct uart_port *port) { return 1; }
+/* Empty only once the xmit buffer, the TX worker and the transmitter are */
+static unsigned int matrixio_uart_tx_empty(struct uart_port *port)
+{
+	struct matrixio_uart *mu = to_matrixio_uart(port);
+	struct matrixio_uart_status uart_status;
+	unsigned long flags;
+	bool pending;
+
+	spin_lock_irqsave(&port->lock, flags);
+	pending = !MATRIXIO_UART_CIRC_EMPTY(port);
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	if (pending || work_busy(&mu->tx_work))
+		return 0;
+
+	if (matrixio_uart_read_status(mu, &uart_status))
+		return TIOCSER_TEMT;
+
+	return uart_status.uart_tx_busy ? 0 : TIOCSER_TEMT;
+}
 
 static void matrixio_uart_set_mctrl(struct uart_port *port, unsigned int mctrl)
 {
@@ -75,30 +170,67 @@ static unsigned int matrixio_uart_get_mctrl(struct uart_port *port)
 
 static void matrixio_uart_stop_tx(struct uart_port *port) {}
 
-static void matrixio_uart_start_tx(struct uart_port *port)
+/* Sends the xmit buffer the way the HAL does.  The transmitter has no
+ * documented FIFO depth, so each character waits for it to go idle and is
+ * written on its own. */
+static void matrixio_uart_tx_work(struct work_struct *w)
 {
+	struct matrixio_uart *mu = container_of(w, struct matrixio_uart, tx_work);
+	struct uart_port *port = &mu->port;
 	struct matrixio_uart_status uart_status;
-	spin_lock(&conf_lock);
-
-	while (1) {
-		do {
-			matrixio_read(matrixio, MATRIXIO_UART_BASE + 0x100,
-				      sizeof(uart_status),
-				      (void *)&uart_status);
-		} while (uart_status.uart_tx_busy);
-
-		matrixio_reg_write(
-		    matrixio, MATRIXIO_UART_BASE + 0x101,
-		    MATRIXIO_UART_XMIT_BUF(port)[MATRIXIO_UART_XMIT_TAIL(port)]);
-		port->state->xmit.tail =
-		    (port->state->xmit.tail + 1) & (UART_XMIT_SIZE - 1);
-		port->icount.tx++;
+	unsigned long flags, deadline;
+	uint16_t c;
+	int ret = 0;
+
+	deadline = jiffies + msecs_to_jiffies(MATRIXIO_UART_TX_TIMEOUT_MS);
+	for (;;) {
+		ret = matrixio_uart_read_status(mu, &uart_status);
+		if (ret)
+			break;
 
-		if (MATRIXIO_UART_CIRC_EMPTY(port))
+		if (uart_status.uart_tx_busy) {
+			if (time_after(jiffies, deadline)) {
+				ret = -ETIMEDOUT;
+				break;
+			}
+			usleep_range(100, 200);
+			continue;
+		}
+		deadline = jiffies + msecs_to_jiffies(MATRIXIO_UART_TX_TIMEOUT_MS);
+
+		spin_lock_irqsave(&port->lock, flags);
+		if (MATRIXIO_UART_CIRC_EMPTY(port)) {
+			spin_unlock_irqrestore(&port->lock, flags);
+			break;
+		}
+		c = MATRIXIO_UART_XMIT_BUF(port)[MATRIXIO_UART_XMIT_TAIL(port)];
+		MATRIXIO_UART_XMIT_SET_TAIL(
+		    port, (MATRIXIO_UART_XMIT_TAIL(port) + 1) &
+			      (UART_XMIT_SIZE - 1));
+		port->icount.tx++;
+		if (uart_circ_chars_pending(MATRIXIO_UART_XMIT(port)) <
+		    WAKEUP_CHARS)
+			uart_write_wakeup(port);
+		spin_unlock_irqrestore(&port->lock, flags);
+
+		mutex_lock(&mu->conf_lock);
+		ret = matrixio_write(mu->mio, mu->base + MATRIXIO_UART_TX,
+				     sizeof(c), &c);
+		mutex_unlock(&mu->conf_lock);
+		if (ret)
 			break;
 	}
 
-	spin_unlock(&conf_lock);
+	if (ret)
+		dev_err_ratelimited(port->dev, "TX failed (%d)\n", ret);
+}
+
+/* Called with the port lock held, so leave the bus to the worker */
+static void matrixio_uart_start_tx(struct uart_port *port)
+{
+	struct matrixio_uart *mu = to_matrixio_uart(port);
+
+	queue_work(mu->workqueue, &mu->tx_work);
 }
 
 static void matrixio_uart_stop_rx(struct uart_port *port) {}
@@ -109,50 +241,66 @@ static void matrixio_uart_break_ctl(struct uart_port *port, int break_state) {}
 
 static int matrixio_uart_startup(struct uart_port *port)
 {
+	struct matrixio_uart *mu = to_matrixio_uart(port);
 	int ret;
 
-	spin_lock(&conf_lock);
+	mutex_lock(&mu->conf_lock);
 
-	matrixio_reg_write(matrixio, MATRIXIO_UART_BASE + 0x102, 1);
-	matrixio_reg_write(matrixio, MATRIXIO_UART_BASE + 0x102, 0);
+	matrixio_reg_write(mu->mio, mu->base + MATRIXIO_UART_UCR, 1);
+	matrixio_reg_write(mu->mio, mu->base + MATRIXIO_UART_UCR, 0);
 
-	spin_unlock(&conf_lock);
+	mutex_unlock(&mu->conf_lock);
 
-	workqueue = create_singlethread_workqueue("matrixio_uart");
+	/* RX and TX work run side by side, only single accesses serialize */
+	mu->workqueue =
+	    alloc_workqueue("matrixio_uart%d", WQ_HIGHPRI, 2, port->line);
 
-	if (!workqueue) {
+	if (!mu->workqueue) {
 		dev_err(port->dev, "cannot create workqueue");
 		return -EBUSY;
 	}
 
-	INIT_WORK(&work, matrixio_uart_work);
-
-	ret = request_irq(irq, uart_rxint, 0, driver_name, matrixio);
+	ret = request_irq(port->irq, uart_rxint, 0, driver_name, mu);
 
 	if (ret) {
-		dev_err(port->dev, "can't request irq %d\n", irq);
-		destroy_workqueue(workqueue);
+		dev_err(port->dev, "can't request irq %d\n", port->irq);
+		destroy_workqueue(mu->workqueue);
 		return -EBUSY;
 	}
 
 	dev_info(port->dev, "MATRIX Creator TTY has been loaded (IRQ=%d,%d)",
-		 irq, ret);
+		 port->irq, ret);
 
-	MATRIXIO_REMOVE_RETURN();
+	return 0;
 }
 
 static void matrixio_uart_shutdown(struct uart_port *port)
 {
-	flush_workqueue(workqueue);
-	destroy_workqueue(workqueue);
-	cancel_work_sync(&work);
-	free_irq(irq, matrixio);
+	struct matrixio_uart *mu = to_matrixio_uart(port);
+
+	free_irq(port->irq, mu);
+	cancel_work_sync(&mu->rx_work);
+	cancel_work_sync(&mu->tx_work);
+	destroy_workqueue(mu->workqueue);
 }
 
+/* Nothing is programmable: any requested rate, parity or stop bits are
+ * replaced with the assumed fixed settings and the line is left as is */
 static void matrixio_uart_set_termios(struct uart_port *port,
 				      struct ktermios *termios,
 				      const struct ktermios *old)
 {
+	unsigned long flags;
+
+	termios->c_cflag &=
+	    ~(CSIZE | CSTOPB | PARENB | PARODD | CMSPAR | CRTSCTS);
+	termios->c_cflag |= CS8 | CLOCAL;
+	tty_termios_encode_baud_rate(termios, MATRIXIO_UART_BAUD,
+				     MATRIXIO_UART_BAUD);
+
+	spin_lock_irqsave(&port->lock, flags);
+	uart_update_timeout(port, termios->c_cflag, MATRIXIO_UART_BAUD);
+	spin_unlock_irqrestore(&port->lock, flags);
 }
 
 static const char *matrixio_uart_type(struct uart_port *port)
@@ -196,7 +344,7 @@ static struct uart_driver matrixio_uart_driver = {
     .dev_name = tty_dev_name,
     .major = TTY_MAJOR,
     .minor = 209,
-    .nr = 1,
+    .nr = MATRIXIO_UART_MAX_PORTS,
 };
 
 static int matrixio_uart_probe(struct platform_device *pdev)
@@ -204,46 +352,62 @@ static int matrixio_uart_probe(struct platform_device *pdev)
 	int ret;
 	struct device *dev = &pdev->dev;
 	struct device_node *np = dev->of_node;
-	matrixio = dev_get_drvdata(pdev->dev.parent);
+	struct matrixio_uart *mu;
+	struct resource *res;
 
-	if (np)
-		dev_dbg(dev, "get of data\n");
+	mu = devm_kzalloc(dev, sizeof(*mu), GFP_KERNEL);
+	if (!mu)
+		return -ENOMEM;
 
-	ret = uart_register_driver(&matrixio_uart_driver);
+	mu->mio = dev_get_drvdata(pdev->dev.parent);
 
-	if (ret != 0) {
-		dev_err(&pdev->dev, "Failed to register MATRIXIO UART: %d\n",
-			ret);
+	/* Older device trees and the default MFD cell may not describe the
+	 * block, in which case it sits at the original fixed address */
+	res = platform_get_resource(pdev, IORESOURCE_REG, 0);
+	mu->base = res ? res->start : MATRIXIO_UART_BASE;
+
+	mutex_init(&mu->conf_lock);
+	INIT_WORK(&mu->rx_work, matrixio_uart_work);
+	INIT_WORK(&mu->tx_work, matrixio_uart_tx_work);
+
+	ret = ida_alloc_max(&matrixio_uart_ida, MATRIXIO_UART_MAX_PORTS - 1,
+			    GFP_KERNEL);
+	if (ret < 0) {
+		dev_err(dev, "No free ttyMATRIX line: %d\n", ret);
 		return ret;
 	}
 
-	spin_lock_init(&conf_lock);
-	irq = irq_of_parse_and_map(np, 0);
-
-	spin_lock_init(&port.lock);
-	port.irq = irq;
-	port.fifosize = 16;
-	port.line = 0;
-	port.ops = &matrixio_uart_ops;
-	port.flags = UPF_SKIP_TEST | UPF_BOOT_AUTOCONF;
-	port.dev = &pdev->dev;
-	port.type = PORT_MAX3100;
-	port.line = 0;
+	spin_lock_init(&mu->port.lock);
+	mu->port.line = ret;
+	mu->port.irq = irq_of_parse_and_map(np, 0);
+	mu->port.uartclk = MATRIXIO_UART_BAUD * 16;
+	mu->port.fifosize = MATRIXIO_UART_FIFO_SIZE;
+	mu->port.ops = &matrixio_uart_ops;
+	mu->port.flags = UPF_SKIP_TEST | UPF_BOOT_AUTOCONF;
+	mu->port.dev = dev;
+	/* There is no PORT_ id for this UART; any non-zero type keeps
+	 * serial_core from treating the port as absent. */
+	mu->port.type = PORT_MAX3100;
 
-	ret = uart_add_one_port(&matrixio_uart_driver, &port);
+	ret = uart_add_one_port(&matrixio_uart_driver, &mu->port);
 
 	if (ret != 0) {
-		dev_err(matrixio->dev, "Failed to add port: %d\n", ret);
+		dev_err(dev, "Failed to add port: %d\n", ret);
+		ida_free(&matrixio_uart_ida, mu->port.line);
 		return ret;
 	}
-	return ret;
+
+	platform_set_drvdata(pdev, mu);
+
+	return 0;
 }
 
 static MATRIXIO_REMOVE_RETURN_TYPE matrixio_uart_remove(struct platform_device *pdev)
 {
-	uart_remove_one_port(&matrixio_uart_driver, &port);
-	port.dev = NULL;
-	uart_unregister_driver(&matrixio_uart_driver);
+	struct matrixio_uart *mu = platform_get_drvdata(pdev);
+
+	uart_remove_one_port(&matrixio_uart_driver, &mu->port);
+	ida_free(&matrixio_uart_ida, mu->port.line);
 	MATRIXIO_REMOVE_RETURN();
 }
 
@@ -264,7 +428,34 @@ static struct platform_driver matrixio_uart_platform_driver = {
 
 };
 
-module_platform_driver(matrixio_uart_platform_driver);
+/* The tty driver spans all ports, so it lives as long as the module */
+static int __init matrixio_uart_init(void)
+{
+	int ret;
+
+	ret = uart_register_driver(&matrixio_uart_driver);
+
+	if (ret != 0) {
+		pr_err("Failed to register MATRIXIO UART: %d\n", ret);
+		return ret;
+	}
+
+	ret = platform_driver_register(&matrixio_uart_platform_driver);
+
+	if (ret != 0)
+		uart_unregister_driver(&matrixio_uart_driver);
+
+	return ret;
+}
+
+static void __exit matrixio_uart_exit(void)
+{
+	platform_driver_unregister(&matrixio_uart_platform_driver);
+	uart_unregister_driver(&matrixio_uart_driver);
+}
+
+module_init(matrixio_uart_init);
+module_exit(matrixio_uart_exit);
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Andres Calderon <andres.calderon@admobilize.com>");
@@ -197,6 +197,84 @@ static void test_buffer_dma_safety(struct kunit *test)
     KUNIT_EXPECT_EQ(test, (unsigned long)mio->rx_buffer % sizeof(void*), 0);
 }
 
+static struct matrixio *create_loopback_matrixio(struct kunit *test)
+{
+    struct matrixio *mio;
+
+    mio = kunit_kzalloc(test, sizeof(*mio), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, mio);
+    mio->loopback.ring = kunit_kcalloc(test, MATRIXIO_LOOPBACK_FRAMES,
+                                       sizeof(*mio->loopback.ring), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, mio->loopback.ring);
+    spin_lock_init(&mio->loopback.lock);
+
+    return mio;
+}
+
+// The first push lands after the frames already queued in the FPGA FIFO
+static void test_loopback_first_push(struct kunit *test)
+{
+    struct matrixio *mio = create_loopback_matrixio(test);
+    uint16_t frames[4][2] = {{1, 2}, {3, 4}, {5, 6}, {7, 8}};
+    uint16_t left[6], right[6];
+    uint16_t expect_left[6] = {0, 0, 1, 3, 5, 7};
+    uint16_t expect_right[6] = {0, 0, 2, 4, 6, 8};
+
+    matrixio_loopback_push(mio, frames, 4, 2);
+    KUNIT_EXPECT_EQ(test, mio->loopback.head, 6);
+
+    matrixio_loopback_pull(mio, left, right, 6);
+    KUNIT_EXPECT_EQ(test, memcmp(left, expect_left, sizeof(left)), 0);
+    KUNIT_EXPECT_EQ(test, memcmp(right, expect_right, sizeof(right)), 0);
+    KUNIT_EXPECT_EQ(test, mio->loopback.tail, 6);
+}
+
+// Pushes while earlier frames are still pending are appended back to back
+static void test_loopback_append(struct kunit *test)
+{
+    struct matrixio *mio = create_loopback_matrixio(test);
+    uint16_t first[2][2] = {{1, 1}, {2, 2}};
+    uint16_t second[2][2] = {{3, 3}, {4, 4}};
+    uint16_t left[4], right[4];
+    uint16_t expect[4] = {1, 2, 3, 4};
+
+    matrixio_loopback_push(mio, first, 2, 0);
+    matrixio_loopback_push(mio, second, 2, 2);
+    KUNIT_EXPECT_EQ(test, mio->loopback.lag, 4);
+
+    matrixio_loopback_sync(mio);
+    KUNIT_EXPECT_EQ(test, mio->loopback.tail, 0);
+
+    matrixio_loopback_pull(mio, left, right, 4);
+    KUNIT_EXPECT_EQ(test, memcmp(left, expect, sizeof(left)), 0);
+    KUNIT_EXPECT_EQ(test, memcmp(right, expect, sizeof(right)), 0);
+}
+
+// A consumer that fell a whole ring behind reads silence, not stale frames
+static void test_loopback_overwritten(struct kunit *test)
+{
+    struct matrixio *mio = create_loopback_matrixio(test);
+    unsigned int count = MATRIXIO_LOOPBACK_FRAMES + 2;
+    uint16_t (*frames)[2];
+    uint16_t left[3], right[3];
+    unsigned int i;
+
+    frames = kunit_kcalloc(test, count, sizeof(*frames), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, frames);
+    for (i = 0; i < count; i++) {
+        frames[i][0] = i + 1;
+        frames[i][1] = i + 1;
+    }
+
+    matrixio_loopback_push(mio, frames, count, 0);
+    matrixio_loopback_pull(mio, left, right, 3);
+
+    KUNIT_EXPECT_EQ(test, left[0], 0);
+    KUNIT_EXPECT_EQ(test, left[1], 0);
+    KUNIT_EXPECT_EQ(test, left[2], 3);
+    KUNIT_EXPECT_EQ(test, right[2], 3);
+}
+
 // KUnit test suite definition
 static struct kunit_case matrixio_core_test_cases[] = {
     KUNIT_CASE(test_hardware_cmd_structure),
@@ -207,6 +285,9 @@ static struct kunit_case matrixio_core_test_cases[] = {
     KUNIT_CASE(test_spi_error_handling),
     KUNIT_CASE(test_register_address_validation),
     KUNIT_CASE(test_buffer_dma_safety),
+    KUNIT_CASE(test_loopback_first_push),
+    KUNIT_CASE(test_loopback_append),
+    KUNIT_CASE(test_loopback_overwritten),
     {}
 };
 
@@ -6,7 +6,7 @@
 
 // Test-specific includes
 #include "../mocks/mock-platform-device.h"
-#include "../../src/matrixio-core.h"
+#include "../../src/matrixio-everloop.h"
 
 // Test constants and structures for Everloop
 #define TEST_EVERLOOP_LED_COUNT 35
@@ -289,6 +289,32 @@ static void test_uevent_generation(struct kunit *test)
     }
 }
 
+#if MATRIXIO_KUNIT_VISIBLE
+// A short write queued behind a full frame must not truncate it
+static void test_short_write_keeps_pending_frame(struct kunit *test)
+{
+    struct matrixio_everloop_dirty r = {0, 0};
+
+    matrixio_everloop_mark_dirty(&r, 0, TEST_EVERLOOP_LED_COUNT * TEST_EVERLOOP_BYTES_PER_LED);
+    matrixio_everloop_mark_dirty(&r, 0, 8);
+
+    KUNIT_EXPECT_EQ(test, r.start, 0);
+    KUNIT_EXPECT_EQ(test, r.end, TEST_EVERLOOP_LED_COUNT * TEST_EVERLOOP_BYTES_PER_LED);
+}
+
+// Disjoint updates merge into one range covering both
+static void test_dirty_ranges_merge(struct kunit *test)
+{
+    struct matrixio_everloop_dirty r = {0, 0};
+
+    matrixio_everloop_mark_dirty(&r, 40, 44);
+    matrixio_everloop_mark_dirty(&r, 8, 12);
+
+    KUNIT_EXPECT_EQ(test, r.start, 8);
+    KUNIT_EXPECT_EQ(test, r.end, 44);
+}
+#endif
+
 // KUnit test suite definition
 static struct kunit_case matrixio_everloop_test_cases[] = {
     KUNIT_CASE(test_led_data_format),
@@ -302,6 +328,10 @@ static struct kunit_case matrixio_everloop_test_cases[] = {
     KUNIT_CASE(test_device_open_close),
     KUNIT_CASE(test_platform_device_integration),
     KUNIT_CASE(test_uevent_generation),
+#if MATRIXIO_KUNIT_VISIBLE
+    KUNIT_CASE(test_short_write_keeps_pending_frame),
+    KUNIT_CASE(test_dirty_ranges_merge),
+#endif
     {}
 };
 
@@ -310,4 +340,8 @@ static struct kunit_suite matrixio_everloop_test_suite = {
     .test_cases = matrixio_everloop_test_cases,
 };
 
-kunit_test_suite(matrixio_everloop_test_suite);
\ No newline at end of file
+kunit_test_suite(matrixio_everloop_test_suite);
+
+#if MATRIXIO_KUNIT_VISIBLE
+MODULE_IMPORT_NS(EXPORTED_FOR_KUNIT_TESTING);
+#endif
@@ -0,0 +1,108 @@
+// Unit tests for the Matrix Creator IMU orientation filter
+#include <kunit/test.h>
+#include <linux/kernel.h>
+
+// Test-specific includes
+#include "../../src/matrixio-imu.h"
+
+#if MATRIXIO_KUNIT_VISIBLE
+
+// Test constants (from matrixio-imu.c)
+#define TEST_AHRS_ONE (1 << 24)
+#define TEST_AHRS_TOL (TEST_AHRS_ONE / 1000) // 0.001 in Q24
+
+// Runs steps filter steps of dt Q24 seconds from the identity orientation
+static void test_ahrs_run(s32 *q, const s32 *g, const s32 *acc,
+                          const s32 *magn, s32 dt, int steps)
+{
+    int i;
+
+    q[0] = TEST_AHRS_ONE;
+    q[1] = q[2] = q[3] = 0;
+    for (i = 0; i < steps; i++)
+        matrixio_ahrs_step(q, g, acc, magn, dt);
+}
+
+// Level and still, the orientation must stay the identity
+static void test_ahrs_level_still(struct kunit *test)
+{
+    s32 g[3] = {0, 0, 0}, acc[3] = {0, 0, 1000}, magn[3] = {0, 0, 0};
+    s32 q[4];
+
+    test_ahrs_run(q, g, acc, magn, TEST_AHRS_ONE / 200, 100);
+
+    KUNIT_EXPECT_EQ(test, q[0], TEST_AHRS_ONE);
+    KUNIT_EXPECT_EQ(test, q[1], 0);
+    KUNIT_EXPECT_EQ(test, q[2], 0);
+    KUNIT_EXPECT_EQ(test, q[3], 0);
+}
+
+// Without accelerometer or magnetometer the gyro is integrated as is:
+// 1 rad/s about z for 1 s is (cos 0.5, 0, 0, sin 0.5)
+static void test_ahrs_gyro_integration(struct kunit *test)
+{
+    s32 g[3] = {0, 0, TEST_AHRS_ONE}, zero[3] = {0, 0, 0};
+    s32 q[4];
+
+    test_ahrs_run(q, g, zero, zero, TEST_AHRS_ONE / 100, 100);
+
+    KUNIT_EXPECT_LE(test, abs(q[0] - 14723392), TEST_AHRS_TOL); // 0.877583
+    KUNIT_EXPECT_LE(test, abs(q[1]), TEST_AHRS_TOL);
+    KUNIT_EXPECT_LE(test, abs(q[2]), TEST_AHRS_TOL);
+    KUNIT_EXPECT_LE(test, abs(q[3] - 8043426), TEST_AHRS_TOL); // 0.479426
+}
+
+// Gravity along +y means the board is rolled 90 degrees about x, the
+// gradient step must converge to (cos 45, sin 45, 0, 0)
+static void test_ahrs_roll_convergence(struct kunit *test)
+{
+    s32 g[3] = {0, 0, 0}, acc[3] = {0, 1000, 0}, zero[3] = {0, 0, 0};
+    s32 q[4];
+
+    test_ahrs_run(q, g, acc, zero, TEST_AHRS_ONE / 200, 4000);
+
+    KUNIT_EXPECT_LE(test, abs(q[0] - 11863283), TEST_AHRS_TOL); // 0.707107
+    KUNIT_EXPECT_LE(test, abs(q[1] - 11863283), TEST_AHRS_TOL);
+    KUNIT_EXPECT_LE(test, abs(q[2]), TEST_AHRS_TOL);
+    KUNIT_EXPECT_LE(test, abs(q[3]), TEST_AHRS_TOL);
+}
+
+// A field along the board's x axis, level with the rolled board, is north
+// along the earth's x axis, so the MARG step must agree with the roll alone
+static void test_ahrs_marg_convergence(struct kunit *test)
+{
+    s32 g[3] = {0, 0, 0}, acc[3] = {0, 9806650, 0};
+    s32 magn[3] = {300000, 0, 0};
+    s32 q[4];
+
+    test_ahrs_run(q, g, acc, magn, TEST_AHRS_ONE / 200, 4000);
+
+    KUNIT_EXPECT_LE(test, abs(q[0] - 11863283), TEST_AHRS_TOL);
+    KUNIT_EXPECT_LE(test, abs(q[1] - 11863283), TEST_AHRS_TOL);
+    KUNIT_EXPECT_LE(test, abs(q[2]), TEST_AHRS_TOL);
+    KUNIT_EXPECT_LE(test, abs(q[3]), TEST_AHRS_TOL);
+}
+
+#endif
+
+// KUnit test suite definition
+static struct kunit_case matrixio_imu_test_cases[] = {
+#if MATRIXIO_KUNIT_VISIBLE
+    KUNIT_CASE(test_ahrs_level_still),
+    KUNIT_CASE(test_ahrs_gyro_integration),
+    KUNIT_CASE(test_ahrs_roll_convergence),
+    KUNIT_CASE(test_ahrs_marg_convergence),
+#endif
+    {}
+};
+
+static struct kunit_suite matrixio_imu_test_suite = {
+    .name = "matrixio-imu",
+    .test_cases = matrixio_imu_test_cases,
+};
+
+kunit_test_suite(matrixio_imu_test_suite);
+
+#if MATRIXIO_KUNIT_VISIBLE
+MODULE_IMPORT_NS(EXPORTED_FOR_KUNIT_TESTING);
+#endif
@@ -232,6 +232,75 @@ static void test_platform_device_integration(struct kunit *test)
     KUNIT_EXPECT_PTR_EQ(test, retrieved_data, regmap_data);
 }
 
+// matrixio_xfer_batch() rejects bad accesses before touching the bus
+static void test_xfer_batch_validation(struct kunit *test)
+{
+    struct matrixio *mio;
+    u8 data[4];
+    struct matrixio_xfer bad_addr = {
+        .add = MATRIXIO_XFER_MAX_ADDR + 1, .length = 2, .data = data};
+    struct matrixio_xfer bad_length = {.add = 0x10, .length = -1, .data = data};
+    struct matrixio_xfer no_data = {.add = 0x10, .length = 2, .data = NULL};
+
+    mio = kunit_kzalloc(test, sizeof(*mio), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, mio);
+
+    KUNIT_EXPECT_EQ(test, matrixio_xfer_batch(mio, &bad_addr, 1), -EINVAL);
+    KUNIT_EXPECT_EQ(test, matrixio_xfer_batch(mio, &bad_length, 1), -EINVAL);
+    KUNIT_EXPECT_EQ(test, matrixio_xfer_batch(mio, &no_data, 1), -EINVAL);
+    KUNIT_EXPECT_EQ(test, matrixio_xfer_batch(mio, &bad_addr, 0), 0);
+}
+
+#if MATRIXIO_KUNIT_VISIBLE
+// Each access is bounced behind its command word, chip select drops between
+static void test_xfer_pack_layout(struct kunit *test)
+{
+    u8 wdata[4] = {0xa1, 0xa2, 0xa3, 0xa4};
+    u8 rdata[2];
+    struct matrixio_xfer xfers[] = {
+        {.add = 0x10, .length = sizeof(wdata), .data = wdata, .read = false},
+        {.add = 0x20, .length = sizeof(rdata), .data = rdata, .read = true},
+    };
+    struct spi_transfer t[2] = {};
+    u8 tx[10], rx[10];
+
+    KUNIT_EXPECT_EQ(test, matrixio_xfer_pack(xfers, 2, tx, rx, t), sizeof(tx));
+
+    KUNIT_EXPECT_EQ(test, (tx[0] | tx[1] << 8), 0x10 << 1);
+    KUNIT_EXPECT_EQ(test, memcmp(tx + 2, wdata, sizeof(wdata)), 0);
+    KUNIT_EXPECT_EQ(test, (tx[6] | tx[7] << 8), (0x20 << 1) | 1);
+
+    KUNIT_EXPECT_PTR_EQ(test, t[0].tx_buf, (const void *)tx);
+    KUNIT_EXPECT_NULL(test, t[0].rx_buf);
+    KUNIT_EXPECT_EQ(test, t[0].len, 6);
+    KUNIT_EXPECT_EQ(test, t[0].cs_change, 1);
+
+    KUNIT_EXPECT_PTR_EQ(test, t[1].tx_buf, (const void *)(tx + 6));
+    KUNIT_EXPECT_PTR_EQ(test, t[1].rx_buf, (void *)(rx + 6));
+    KUNIT_EXPECT_EQ(test, t[1].len, 4);
+    KUNIT_EXPECT_EQ(test, t[1].cs_change, 0);
+}
+
+// Read data is copied back from behind each command word, writes are left alone
+static void test_xfer_unpack(struct kunit *test)
+{
+    u8 wdata[2] = {0x11, 0x22};
+    u8 rdata[2] = {0, 0};
+    struct matrixio_xfer xfers[] = {
+        {.add = 0x10, .length = sizeof(wdata), .data = wdata, .read = false},
+        {.add = 0x20, .length = sizeof(rdata), .data = rdata, .read = true},
+    };
+    u8 rx[8] = {0xff, 0xff, 0xee, 0xee, 0xff, 0xff, 0x5a, 0xa5};
+
+    matrixio_xfer_unpack(xfers, 2, rx);
+
+    KUNIT_EXPECT_EQ(test, wdata[0], 0x11);
+    KUNIT_EXPECT_EQ(test, wdata[1], 0x22);
+    KUNIT_EXPECT_EQ(test, rdata[0], 0x5a);
+    KUNIT_EXPECT_EQ(test, rdata[1], 0xa5);
+}
+#endif
+
 // KUnit test suite definition
 static struct kunit_case matrixio_regmap_test_cases[] = {
     KUNIT_CASE(test_regmap_data_init),
@@ -244,6 +313,11 @@ static struct kunit_case matrixio_regmap_test_cases[] = {
     KUNIT_CASE(test_regmap_concurrent_access),
     KUNIT_CASE(test_device_class_management),
     KUNIT_CASE(test_platform_device_integration),
+    KUNIT_CASE(test_xfer_batch_validation),
+#if MATRIXIO_KUNIT_VISIBLE
+    KUNIT_CASE(test_xfer_pack_layout),
+    KUNIT_CASE(test_xfer_unpack),
+#endif
     {}
 };
 
@@ -252,4 +326,8 @@ static struct kunit_suite matrixio_regmap_test_suite = {
     .test_cases = matrixio_regmap_test_cases,
 };
 
-kunit_test_suite(matrixio_regmap_test_suite);
\ No newline at end of file
+kunit_test_suite(matrixio_regmap_test_suite);
+
+#if MATRIXIO_KUNIT_VISIBLE
+MODULE_IMPORT_NS(EXPORTED_FOR_KUNIT_TESTING);
+#endif